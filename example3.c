@@ -20,6 +20,7 @@ int main (int argc, char **argv) {
         return 1;
     }
     rx_print(rx);
+    rx_explain(rx);
 
     matcher_t *m = rx_matcher_alloc();
     rx_match(rx, m, strlen(string), string, 0);
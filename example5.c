@@ -1,10 +1,27 @@
 // This is a grep program.
 // It shows multiline matches well.
+//
+// Files are searched in parallel. Walking the directories and searching the files
+// are split into tasks which a pool of threads runs, each thread taking tasks from
+// its own queue and stealing from the other threads' queues when its own runs out.
+// Every thread has its own rx_t and matcher_t. Files are mapped into memory instead
+// of being read. The output for each file is written to a buffer, and the main
+// thread prints the buffers in the order the files were found, so the output is
+// the same no matter how many threads there are.
+//
+// In line mode (-L, or implied by -v and -c) the matches are reported a line at a
+// time like a regular grep. The whole buffer is searched for a match, which skips
+// over the lines that can't match without looking at them one by one, and then
+// the line it was found on is checked on its own.
+//
+// A file with a zero byte near its start is taken to be binary. Binary files
+// aren't shown, the search stops at the first match and just says it matched.
 
 #include "rx.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <sys/stat.h>
@@ -14,18 +31,96 @@
 #else
     #include <unistd.h>
     #include <dirent.h>
+    #include <pthread.h>
+    #include <sys/mman.h>
 #endif
 
-rx_t *rx;
-matcher_t *m;
-int data_size;
-int data_allocated;
-char *data;
-int line;
-int line_byte;
-int match_count;
+#ifdef _WIN32
+    // There is no thread pool on windows, all the tasks are run by the main thread
+    // before the output is printed.
+    typedef int pthread_mutex_t;
+    typedef int pthread_cond_t;
+    #define pthread_mutex_init(mutex, attr)
+    #define pthread_mutex_lock(mutex)
+    #define pthread_mutex_unlock(mutex)
+    #define pthread_cond_init(cond, attr)
+    #define pthread_cond_wait(cond, mutex)
+    #define pthread_cond_signal(cond)
+    #define pthread_cond_broadcast(cond)
+#endif
+
+// rx_match() takes int sizes, so files bigger than this are searched a window at
+// a time, each window ending at a newline.
+#define WINDOW_SIZE (1 << 30)
+
+typedef struct {
+    int size;
+    int allocated;
+    char *str;
+} outbuf_t;
+
+// A task is either a directory to list or a file to search. The tasks form a tree
+// in the order the files were found, which is the order they get printed in.
+typedef struct task_t task_t;
+struct task_t {
+    char *file;
+    int size;
+    task_t *first_child;
+    task_t *last_child;
+    task_t *next;
+    outbuf_t out;
+    int done;
+};
+
+typedef struct {
+    pthread_mutex_t mutex;
+    int count;
+    int allocated;
+    task_t **tasks;
+} deque_t;
+
+typedef struct {
+    int id;
+    rx_t *rx;
+    matcher_t *m;
+#ifndef _WIN32
+    pthread_t thread;
+#endif
+} worker_t;
+
+// The state of searching one file
+typedef struct {
+    rx_t *rx;
+    matcher_t *m;
+    outbuf_t *out;
+    char *data;
+    int data_size;
+    int line;
+    int line_byte;
+    int old_line;
+    int end;
+    int match_count;
+    int binary;
+} search_t;
+
+char *regexp;
 int before;
 int after;
+int line_mode;
+int invert;
+int count_only;
+int per_line;
+int skip_binary;
+int binary_as_text;
+int threads_count;
+worker_t *workers;
+deque_t *deques;
+pthread_mutex_t pool_mutex;
+pthread_cond_t pool_cond;
+int tasks_pending;
+int tasks_pushed;
+pthread_mutex_t done_mutex;
+pthread_cond_t done_cond;
 
 #define eq(a, b) (strcmp(a, b) == 0)
 
@@ -39,18 +134,50 @@ void usage () {
         "    -h          help text\n"
         "    -A <n>      after context\n"
         "    -B <n>      before context\n"
-        "    -C <n>      before and after context";
+        "    -C <n>      before and after context\n"
+        "    -j <n>      number of threads to search with\n"
+        "    -L          line mode, show the lines that match\n"
+        "    -v          show the lines that don't match, implies -L\n"
+        "    -c          only show the number of lines, implies -L\n"
+        "    -I          skip binary files\n"
+        "    -a          search binary files as if they were text";
     puts(str);
     exit(0);
 }
 
-void read_file (int fd) {
-    data_size = 0;
-    int chunk_size = 16384;
-    if (data_allocated == 0) {
-        data_allocated = 2 * chunk_size;
-        data = malloc(data_allocated);
+void out_printf (outbuf_t *o, char *fmt, ...) {
+    va_list args;
+    if (o->allocated == 0) {
+        o->allocated = 4096;
+        o->str = malloc(o->allocated);
+    }
+    while (1) {
+        int avail = o->allocated - o->size;
+        va_start(args, fmt);
+        int n = vsnprintf(o->str + o->size, avail, fmt, args);
+        va_end(args);
+        if (n < avail) {
+            o->size += n;
+            return;
+        }
+        o->allocated = 2 * (o->allocated + n);
+        o->str = realloc(o->str, o->allocated);
     }
+}
+
+void out_free (outbuf_t *o) {
+    free(o->str);
+    o->str = NULL;
+    o->size = 0;
+    o->allocated = 0;
+}
+
+// Reads all of stdin, which can't be mapped into memory.
+int read_fd (int fd, char **data2) {
+    int data_size = 0;
+    int chunk_size = 16384;
+    int data_allocated = 2 * chunk_size;
+    char *data = malloc(data_allocated);
     int retval;
     while (1) {
         if (data_size + chunk_size > data_allocated) {
@@ -67,49 +194,86 @@ void read_file (int fd) {
             data_size += retval;
         }
     }
+    *data2 = data;
+    return data_size;
+}
+
+char *map_file (int fd, long long size) {
+#ifdef _WIN32
+    char *data = malloc(size);
+    long long data_size = 0;
+    while (data_size < size) {
+        int retval = read(fd, data + data_size, size - data_size > WINDOW_SIZE ? WINDOW_SIZE : size - data_size);
+        if (retval <= 0) {
+            break;
+        }
+        data_size += retval;
+    }
+    return data;
+#else
+    char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+    return data;
+#endif
+}
+
+void unmap_file (char *data, long long size) {
+#ifdef _WIN32
+    free(data);
+#else
+    munmap(data, size);
+#endif
 }
 
 // The regexp doesn't track what line number it was found on, so we go back
 // and find out after finding the match, we can speed things up for multiple
 // matches by storing the last byte number the line was found on, and only
 // start the search from there.
-void find_line (int pos) {
-    for (int i = line_byte; i < pos; i += 1) {
-        if (data[i] == '\n') {
-            line += 1;
+void find_line (search_t *s, int pos) {
+    char *p = s->data + s->line_byte;
+    char *p2 = s->data + pos;
+    while (p < p2) {
+        p = memchr(p, '\n', p2 - p);
+        if (!p) {
+            break;
         }
+        s->line += 1;
+        p += 1;
     }
-    line_byte = pos;
+    s->line_byte = pos;
 }
 
 // Show all text leading to the start of this match, the previous match's position
 // is stored in end, if it occurs on the same line, show from end to start, otherwise
 // it will show from the beginning of the line.
-void show_pre_text (int end, int start) {
+void show_pre_text (search_t *s, int end, int start) {
     int i;
     for (i = start; i >= 1; i -= 1) {
-        if (data[i - 1] == '\n') {
+        if (s->data[i - 1] == '\n') {
             break;
         } else if (i == end) {
             break;
         }
     }
     if (i < start) {
-        printf("%.*s", start - i, data + i);
+        out_printf(s->out, "%.*s", start - i, s->data + i);
     }
 }
 
 // Show the remaining line from the end of the last match. Returns the end position
 // of the post text.
-int show_post_text (int end) {
+int show_post_text (search_t *s, int end) {
     int i;
-    for (i = end; i < data_size; i += 1) {
-        if (data[i] == '\n' || data[i] == '\r') {
+    for (i = end; i < s->data_size; i += 1) {
+        if (s->data[i] == '\n' || s->data[i] == '\r') {
             break;
         }
     }
     if (i >= end) {
-        printf("%.*s\n", i - end, data + end);
+        out_printf(s->out, "%.*s\n", i - end, s->data + end);
     }
     return i + 1;
 }
@@ -117,7 +281,8 @@ int show_post_text (int end) {
 // Show the context of the file for the lines before start (start doesn't necessarily
 // start at a newline) and doesn't go past (backwards) the end of the previous text
 // that was output.
-void show_before_context (int start, int end, int old_line) {
+void show_before_context (search_t *s, int start, int end, int old_line) {
+    char *data = s->data;
     int i, j;
     for (i = start; i >= 1; i -= 1) {
         if (data[i - 1] == '\n') {
@@ -156,29 +321,29 @@ void show_before_context (int start, int end, int old_line) {
     // The number of lines before is bounded by what was previously output,
     // actual_before is the number of lines we can actually show.
     int actual_before = j;
-    if (line - before > old_line + after && old_line != 1) {
-        printf("--\n");
+    if (s->line - before > old_line + after && old_line != 1) {
+        out_printf(s->out, "--\n");
     }
     for (j = 0; j < actual_before; j += 1) {
-        printf("%d: ", line - actual_before + j);
+        out_printf(s->out, "%d: ", s->line - actual_before + j);
         for (i = context_start;; i += 1) {
             if (data[i] == '\n') {
                 break;
             }
         }
-        printf("%.*s\n", i - context_start, data + context_start);
+        out_printf(s->out, "%.*s\n", i - context_start, data + context_start);
         context_start = i + 1;
     }
 }
 
 // Show the after context starting the line after the end of the last match, and
 // not including the line of the start of the current match.
-int show_after_context (int end, int start, int old_line) {
+int show_after_context (search_t *s, int end, int start, int old_line) {
     int i, j = 0, line_start = end;
     for (i = end; i < start; i += 1) {
-        if (data[i] == '\n') {
-            printf("%d: ", old_line + j + 1);
-            printf("%.*s\n", i - line_start, data + line_start);
+        if (s->data[i] == '\n') {
+            out_printf(s->out, "%d: ", old_line + j + 1);
+            out_printf(s->out, "%.*s\n", i - line_start, s->data + line_start);
             line_start = i + 1;
             j += 1;
             if (j == after) {
@@ -189,113 +354,476 @@ int show_after_context (int end, int start, int old_line) {
     return line_start;
 }
 
-void process_file (int fd, char *file) {
-    read_file(fd);
-    line = 1;
-    line_byte = 0;
-    int old_line = 1;
+// Searches one window of a file, s->line carries on from the previous window.
+void search_window (search_t *s, char *file) {
+    rx_t *rx = s->rx;
+    matcher_t *m = s->m;
     int pos = 0;
-    int end = 0;
-    int file_match_count = 0;
-    while (1) {
-        rx_match(rx, m, data_size, data, pos);
+    int file_match_count = s->match_count;
+    s->line_byte = 0;
+    s->old_line = s->line;
+    s->end = 0;
+    while (pos <= s->data_size) {
+        rx_match(rx, m, s->data_size, s->data, pos);
         if (!m->success) {
             break;
         }
+        if (s->binary) {
+            s->match_count += 1;
+            return;
+        }
         if (pos == m->cap_end[0]) {
             pos += 1;
         } else {
             pos = m->cap_end[0];
         }
 
-        if (file_match_count == 0 && fd != 0) {
-            if (match_count > 0) {
-                printf("\n");
-            }
-            printf("\x1b[1;32m%s\x1b[0m\n", file);
+        if (s->match_count == 0) {
+            out_printf(s->out, "\x1b[1;32m%s\x1b[0m\n", file);
         }
         int start = m->cap_start[0];
-        find_line(start);
-        if (line > old_line || file_match_count == 0) {
-            if (file_match_count) {
-                end = show_post_text(end);
+        find_line(s, start);
+        if (s->line > s->old_line || s->match_count == file_match_count) {
+            if (s->match_count != file_match_count) {
+                s->end = show_post_text(s, s->end);
                 if (after) {
-                    end = show_after_context(end, start, old_line);
+                    s->end = show_after_context(s, s->end, start, s->old_line);
                 }
             }
             if (before) {
-                show_before_context(start, end, old_line);
+                show_before_context(s, start, s->end, s->old_line);
             }
-            printf("\x1b[1;33m%d\x1b[0m: ", line);
+            out_printf(s->out, "\x1b[1;33m%d\x1b[0m: ", s->line);
         }
-        show_pre_text(end, start);
+        show_pre_text(s, s->end, start);
         // The \x1b[0K makes it color nicely when the match contains a newline
-        printf("\x1b[103m\x1b[30m%.*s\x1b[0m\x1b[0K", m->cap_size[0], m->cap_str[0]);
-        end = m->cap_end[0];
-        find_line(end);
-        old_line = line;
-        match_count += 1;
-        file_match_count += 1;
-    }
-    if (file_match_count) {
-        end = show_post_text(end);
+        out_printf(s->out, "\x1b[103m\x1b[30m%.*s\x1b[0m\x1b[0K", m->cap_size[0], m->cap_str[0]);
+        s->end = m->cap_end[0];
+        find_line(s, s->end);
+        s->old_line = s->line;
+        s->match_count += 1;
+    }
+    if (s->match_count != file_match_count) {
+        s->end = show_post_text(s, s->end);
         if (after) {
-            end = show_after_context(end, data_size, old_line);
+            s->end = show_after_context(s, s->end, s->data_size, s->old_line);
+        }
+    }
+    find_line(s, s->data_size);
+}
+
+// Finds the first line starting at or after pos that has a match in it. Returns 1
+// and sets line_start and line_end (not including the newline) if one was found.
+int find_matching_line (search_t *s, int pos, int *line_start, int *line_end) {
+    rx_t *rx = s->rx;
+    matcher_t *m = s->m;
+    char *data = s->data;
+    while (pos < s->data_size) {
+        int start = pos;
+        if (!per_line) {
+            rx_match(rx, m, s->data_size, data, pos);
+            if (!m->success || m->cap_start[0] >= s->data_size) {
+                return 0;
+            }
+            start = m->cap_start[0];
+        }
+        int i;
+        for (i = start; i > pos; i -= 1) {
+            if (data[i - 1] == '\n') {
+                break;
+            }
+        }
+        char *p = memchr(data + start, '\n', s->data_size - start);
+        int end = p ? p - data : s->data_size;
+        *line_start = i;
+        *line_end = end;
+
+        // A match that didn't go past the end of the line would also be found
+        // when looking at the line alone.
+        if (!per_line && m->cap_end[0] <= end) {
+            return 1;
+        }
+        if (rx_match(rx, m, end - i, data + i, 0)) {
+            return 1;
+        }
+        pos = end + 1;
+    }
+    return 0;
+}
+
+void show_line (search_t *s, int start, int end, int highlight) {
+    out_printf(s->out, "\x1b[1;33m%d\x1b[0m: ", s->line);
+    int pos = 0, prev = 0, size = end - start;
+    char *line = s->data + start;
+    while (highlight && pos <= size) {
+        rx_match(s->rx, s->m, size, line, pos);
+        if (!s->m->success) {
+            break;
+        }
+        matcher_t *m = s->m;
+        out_printf(s->out, "%.*s", m->cap_start[0] - prev, line + prev);
+        out_printf(s->out, "\x1b[103m\x1b[30m%.*s\x1b[0m", m->cap_size[0], m->cap_str[0]);
+        prev = m->cap_end[0];
+        pos = m->cap_end[0] > pos ? m->cap_end[0] : pos + 1;
+    }
+    out_printf(s->out, "%.*s\n", size - prev, line + prev);
+}
+
+// Searches one window of a file a line at a time. The lines in between the
+// matching lines are only looked at when they will be shown or counted with -v.
+void search_window_lines (search_t *s, char *file) {
+    int pos = 0;
+    s->line_byte = 0;
+    while (pos < s->data_size) {
+        int line_start, line_end;
+        int found = find_matching_line(s, pos, &line_start, &line_end);
+        if (!found) {
+            line_start = line_end = s->data_size;
+        }
+        if (s->binary && (invert ? pos < line_start : found)) {
+            s->match_count += 1;
+            return;
+        }
+        if (invert) {
+            while (pos < line_start) {
+                char *p = memchr(s->data + pos, '\n', line_start - pos);
+                int end = p ? p - s->data : line_start;
+                if (!count_only) {
+                    if (s->match_count == 0) {
+                        out_printf(s->out, "\x1b[1;32m%s\x1b[0m\n", file);
+                    }
+                    find_line(s, pos);
+                    show_line(s, pos, end, 0);
+                }
+                s->match_count += 1;
+                pos = end + 1;
+            }
+        } else if (found) {
+            if (!count_only) {
+                if (s->match_count == 0) {
+                    out_printf(s->out, "\x1b[1;32m%s\x1b[0m\n", file);
+                }
+                find_line(s, line_start);
+                show_line(s, line_start, line_end, 1);
+            }
+            s->match_count += 1;
+        }
+        if (!found) {
+            break;
+        }
+        pos = line_end + 1;
+    }
+    find_line(s, s->data_size);
+}
+
+// Searches the data of a whole file, file is "stdin" for what's piped in.
+void search_data (worker_t *w, outbuf_t *out, char *data, long long size, char *file) {
+    search_t s = {0};
+    s.rx = w->rx;
+    s.m = w->m;
+    s.out = out;
+    s.line = 1;
+    if (!binary_as_text && memchr(data, '\0', size < 8192 ? size : 8192)) {
+        if (skip_binary) {
+            return;
+        }
+        // Counting still looks at every line.
+        s.binary = !count_only;
+    }
+    long long done = 0;
+    do {
+        long long window_size = size - done;
+        if (window_size > WINDOW_SIZE) {
+            window_size = WINDOW_SIZE;
+            for (long long i = window_size; i > 0; i -= 1) {
+                if (data[done + i - 1] == '\n') {
+                    window_size = i;
+                    break;
+                }
+            }
         }
+        s.data = data + done;
+        s.data_size = window_size;
+        if (line_mode) {
+            search_window_lines(&s, file);
+        } else {
+            search_window(&s, file);
+        }
+        done += window_size;
+    } while (done < size && !(s.binary && s.match_count));
+    if (s.binary && s.match_count) {
+        out_printf(out, "Binary file %s matches\n", file);
+    }
+    if (count_only) {
+        out_printf(out, "%s:%d\n", file, s.match_count);
     }
 }
 
-void find (int size, char *file) {
+void search_file (worker_t *w, task_t *t) {
+    int fd = open(t->file, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Can't open %s: %s\n", t->file, strerror(errno));
+        return;
+    }
     struct stat st;
-    int retval = stat(file, &st);
-    if (retval < 0) {
-        fprintf(stderr, "Can't stat %s: %s\n", file, strerror(errno));
+    if (fstat(fd, &st) < 0) {
+        fprintf(stderr, "Can't stat %s: %s\n", t->file, strerror(errno));
+        close(fd);
+        return;
+    }
+    long long size = st.st_size;
+    if (size == 0) {
+        search_data(w, &t->out, "", 0, t->file);
+        close(fd);
+        return;
+    }
+    char *data = map_file(fd, size);
+    if (!data) {
+        fprintf(stderr, "Can't map %s: %s\n", t->file, strerror(errno));
+        close(fd);
         return;
     }
+    search_data(w, &t->out, data, size, t->file);
+    unmap_file(data, size);
+    close(fd);
+}
+
+task_t *task_create (task_t *parent, int size, char *file) {
+    task_t *t = calloc(1, sizeof(task_t));
+    t->size = size;
+    t->file = malloc(size + 1);
+    memcpy(t->file, file, size);
+    t->file[size] = '\0';
+    if (parent) {
+        if (parent->last_child) {
+            parent->last_child->next = t;
+        } else {
+            parent->first_child = t;
+        }
+        parent->last_child = t;
+    }
+    return t;
+}
+
+// The owner of a deque pushes and pops at the back, other threads steal from the
+// front, so the owner works depth first and thieves take the oldest, biggest tasks.
+void task_push (int id, task_t *t) {
+    pthread_mutex_lock(&pool_mutex);
+    tasks_pending += 1;
+    tasks_pushed += 1;
+    pthread_mutex_unlock(&pool_mutex);
+
+    deque_t *d = deques + id;
+    pthread_mutex_lock(&d->mutex);
+    if (d->count == d->allocated) {
+        d->allocated = d->allocated ? d->allocated * 2 : 64;
+        d->tasks = realloc(d->tasks, d->allocated * sizeof(task_t *));
+    }
+    d->tasks[d->count] = t;
+    d->count += 1;
+    pthread_mutex_unlock(&d->mutex);
+
+    pthread_mutex_lock(&pool_mutex);
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+task_t *task_pop (int id) {
+    deque_t *d = deques + id;
+    task_t *t = NULL;
+    pthread_mutex_lock(&d->mutex);
+    if (d->count) {
+        d->count -= 1;
+        t = d->tasks[d->count];
+    }
+    pthread_mutex_unlock(&d->mutex);
+    return t;
+}
+
+task_t *task_steal (int id) {
+    for (int i = 1; i < threads_count; i += 1) {
+        deque_t *d = deques + (id + i) % threads_count;
+        task_t *t = NULL;
+        pthread_mutex_lock(&d->mutex);
+        if (d->count) {
+            t = d->tasks[0];
+            d->count -= 1;
+            memmove(d->tasks, d->tasks + 1, d->count * sizeof(task_t *));
+        }
+        pthread_mutex_unlock(&d->mutex);
+        if (t) {
+            return t;
+        }
+    }
+    return NULL;
+}
+
+// Pushes the children of a task in reverse so the first one found is the first
+// one popped.
+void push_children (int id, task_t *t) {
+    int count = 0;
+    for (task_t *c = t->first_child; c; c = c->next) {
+        count += 1;
+    }
+    task_t **children = malloc(count * sizeof(task_t *));
+    count = 0;
+    for (task_t *c = t->first_child; c; c = c->next) {
+        children[count] = c;
+        count += 1;
+    }
+    for (int i = count - 1; i >= 0; i -= 1) {
+        task_push(id, children[i]);
+    }
+    free(children);
+}
 
-    if ((st.st_mode & S_IFMT) == S_IFDIR) {
-        // recurse
+// Lists the directory into child tasks.
+void list_dir (worker_t *w, task_t *t) {
 #ifdef _WIN32
-        WIN32_FIND_DATA fd;
-        char file2[MAX_PATH];
-        _snprintf(file2, MAX_PATH, "%s\\*", file);
-        HANDLE h = FindFirstFile(file2, &fd);
-        if (h == INVALID_HANDLE_VALUE) {
-            fprintf(stderr, "Can't find file: %s\n", file2);
-            return;
+    WIN32_FIND_DATA fd;
+    char file2[MAX_PATH];
+    _snprintf(file2, MAX_PATH, "%s\\*", t->file);
+    HANDLE h = FindFirstFile(file2, &fd);
+    if (h == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "Can't find file: %s\n", file2);
+        return;
+    }
+    do {
+        if (eq(fd.cFileName, ".") || eq(fd.cFileName, "..")) {
+            continue;
         }
-        do {
-            if (eq(fd.cFileName, ".") || eq(fd.cFileName, "..")) {
-                continue;
-            }
-            int size2 = _snprintf(file2, MAX_PATH, "%s\\%s", file, fd.cFileName);
-            find(size2, file2);
-        } while (FindNextFile(h, &fd));
-        FindClose(h);
+        int size2 = _snprintf(file2, MAX_PATH, "%s\\%s", t->file, fd.cFileName);
+        task_create(t, size2, file2);
+    } while (FindNextFile(h, &fd));
+    FindClose(h);
 #else
-        DIR *dp = opendir(file);
-        struct dirent *de;
-        while ((de = readdir(dp))) {
-            if (eq(de->d_name, ".") || eq(de->d_name, "..")) {
-                continue;
-            }
-            int size2 = size + strlen(de->d_name) + 2;
-            char *file2 = malloc(size2);
-            sprintf(file2, "%s/%s", file, de->d_name);
-            find(size2, file2);
-            free(file2);
+    DIR *dp = opendir(t->file);
+    if (!dp) {
+        fprintf(stderr, "Can't open %s: %s\n", t->file, strerror(errno));
+        return;
+    }
+    struct dirent *de;
+    int allocated = 0;
+    char *file2 = NULL;
+    while ((de = readdir(dp))) {
+        if (eq(de->d_name, ".") || eq(de->d_name, "..")) {
+            continue;
+        }
+        int size2 = t->size + strlen(de->d_name) + 1;
+        if (size2 + 1 > allocated) {
+            allocated = 2 * (size2 + 1);
+            file2 = realloc(file2, allocated);
         }
-        closedir(dp);
+        sprintf(file2, "%s/%s", t->file, de->d_name);
+        task_create(t, size2, file2);
+    }
+    free(file2);
+    closedir(dp);
 #endif
+
+    push_children(w->id, t);
+}
+
+void task_run (worker_t *w, task_t *t) {
+    struct stat st;
+    int retval = stat(t->file, &st);
+    if (retval < 0) {
+        fprintf(stderr, "Can't stat %s: %s\n", t->file, strerror(errno));
+    } else if ((st.st_mode & S_IFMT) == S_IFDIR) {
+        list_dir(w, t);
     } else {
-        int fd = open(file, O_RDONLY);
-        if (fd < 0) {
-            fprintf(stderr, "Can't open %s: %s\n", file, strerror(errno));
-            return;
+        search_file(w, t);
+    }
+
+    pthread_mutex_lock(&done_mutex);
+    t->done = 1;
+    pthread_cond_broadcast(&done_cond);
+    pthread_mutex_unlock(&done_mutex);
+}
+
+void *worker_main (void *arg) {
+    worker_t *w = arg;
+    while (1) {
+        pthread_mutex_lock(&pool_mutex);
+        int pushed = tasks_pushed;
+        pthread_mutex_unlock(&pool_mutex);
+
+        task_t *t = task_pop(w->id);
+        if (!t) {
+            t = task_steal(w->id);
         }
-        process_file(fd, file);
-        close(fd);
+        if (!t) {
+            // Nothing to do, wait for a running task to push more, unless
+            // everything is finished.
+            pthread_mutex_lock(&pool_mutex);
+            if (tasks_pending == 0) {
+                pthread_mutex_unlock(&pool_mutex);
+                break;
+            }
+            if (pushed == tasks_pushed) {
+                pthread_cond_wait(&pool_cond, &pool_mutex);
+            }
+            pthread_mutex_unlock(&pool_mutex);
+            continue;
+        }
+
+        task_run(w, t);
+
+        pthread_mutex_lock(&pool_mutex);
+        tasks_pending -= 1;
+        if (tasks_pending == 0) {
+            pthread_cond_broadcast(&pool_cond);
+        }
+        pthread_mutex_unlock(&pool_mutex);
+    }
+    return NULL;
+}
+
+// Prints the output of the tasks depth first, in the order they were found,
+// waiting for each one to finish.
+int print_tasks (task_t *root, int printed) {
+    int count = 1, allocated = 64;
+    task_t **stack = malloc(allocated * sizeof(task_t *));
+    stack[0] = root;
+    while (count) {
+        count -= 1;
+        task_t *t = stack[count];
+
+        pthread_mutex_lock(&done_mutex);
+        while (!t->done) {
+            pthread_cond_wait(&done_cond, &done_mutex);
+        }
+        pthread_mutex_unlock(&done_mutex);
+
+        if (t->out.size) {
+            if (printed && !count_only) {
+                fputc('\n', stdout);
+            }
+            fwrite(t->out.str, 1, t->out.size, stdout);
+            printed = 1;
+        }
+
+        int children_count = 0;
+        for (task_t *c = t->first_child; c; c = c->next) {
+            children_count += 1;
+        }
+        if (count + children_count > allocated) {
+            allocated = 2 * (count + children_count);
+            stack = realloc(stack, allocated * sizeof(task_t *));
+        }
+        int i = count + children_count - 1;
+        for (task_t *c = t->first_child; c; c = c->next) {
+            stack[i] = c;
+            i -= 1;
+        }
+        count += children_count;
+
+        out_free(&t->out);
+        free(t->file);
+        free(t);
     }
+    free(stack);
+    return printed;
 }
 
 int main (int argc, char **argv) {
@@ -341,6 +869,24 @@ int main (int argc, char **argv) {
             }
             after = before = atoi(argv[i + 1]);
             i += 1;
+        } else if (eq(argv[i], "-j")) {
+            if (i + 1 == argc) {
+                printf("Expected argument after -j.\n");
+            }
+            threads_count = atoi(argv[i + 1]);
+            i += 1;
+        } else if (eq(argv[i], "-L")) {
+            line_mode = 1;
+        } else if (eq(argv[i], "-v")) {
+            line_mode = 1;
+            invert = 1;
+        } else if (eq(argv[i], "-c")) {
+            line_mode = 1;
+            count_only = 1;
+        } else if (eq(argv[i], "-I")) {
+            skip_binary = 1;
+        } else if (eq(argv[i], "-a")) {
+            binary_as_text = 1;
         } else if (eq(argv[i], "--")) {
             for (i += 1; i < argc; i += 1) {
                 argv[j] = argv[i];
@@ -360,28 +906,94 @@ int main (int argc, char **argv) {
         printf("A regexp is required.\n");
         return 1;
     }
-    char *regexp = argv[1];
-    rx = rx_alloc();
-    rx_init(rx, strlen(regexp), regexp);
-    if (rx->error) {
-        puts(rx->errorstr);
-        return 1;
+    regexp = argv[1];
+
+#ifdef _WIN32
+    threads_count = 1;
+#else
+    if (threads_count <= 0) {
+        threads_count = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (threads_count <= 0) {
+        threads_count = 1;
+    }
+#endif
+
+    workers = calloc(threads_count, sizeof(worker_t));
+    deques = calloc(threads_count, sizeof(deque_t));
+    for (i = 0; i < threads_count; i += 1) {
+        worker_t *w = workers + i;
+        w->id = i;
+        w->rx = rx_alloc();
+        rx_init(w->rx, strlen(regexp), regexp);
+        if (w->rx->error) {
+            puts(w->rx->errorstr);
+            return 1;
+        }
+        w->m = rx_matcher_alloc();
+        pthread_mutex_init(&deques[i].mutex, NULL);
+    }
+
+    // Matching the whole buffer finds every match that could be found by
+    // matching each line alone, unless the regexp is anchored to the start or
+    // end of the string, which is the start or end of the line in line mode.
+    // An atomic group or possessive quantifier can also take in the newline and
+    // then not give it back, like a[^b]*+$ on "a\nb", which fails on the whole
+    // buffer but matches the first line alone.
+    for (i = 0; i < workers->rx->nodes_count; i += 1) {
+        node_t *n = workers->rx->nodes[i];
+        if (n->type == ASSERTION && (n->value == ASSERT_SOS || n->value == ASSERT_EOS || n->value == ASSERT_SOP)) {
+            per_line = 1;
+        } else if (n->type == ATOMIC_START) {
+            per_line = 1;
+        }
     }
-    m = rx_matcher_alloc();
+    pthread_mutex_init(&pool_mutex, NULL);
+    pthread_cond_init(&pool_cond, NULL);
+    pthread_mutex_init(&done_mutex, NULL);
+    pthread_cond_init(&done_cond, NULL);
 
+    int printed = 0;
     if (!isatty(0)) {
-        process_file(0, "stdin");
+        outbuf_t out = {0};
+        char *data;
+        int data_size = read_fd(0, &data);
+        search_data(workers, &out, data, data_size, "stdin");
+        fwrite(out.str, 1, out.size, stdout);
+        printed = out.size > 0;
+        out_free(&out);
+        free(data);
     } else if (argc == 2) {
         argv[argc] = ".";
         argc += 1;
     }
 
+    // The files given on the command line are the children of a root task that
+    // doesn't do anything itself.
+    task_t *root = task_create(NULL, 0, "");
     for (int i = 2; i < argc; i += 1) {
         char *file = argv[i];
-        int size = strlen(file);
-        find(size, file);
+        task_create(root, strlen(file), file);
+    }
+    root->done = 1;
+    push_children(0, root);
+
+#ifdef _WIN32
+    worker_main(workers);
+#else
+    for (i = 0; i < threads_count; i += 1) {
+        pthread_create(&workers[i].thread, NULL, worker_main, workers + i);
     }
+#endif
+
+    print_tasks(root, printed);
+    fflush(stdout);
+
+#ifndef _WIN32
+    for (i = 0; i < threads_count; i += 1) {
+        pthread_join(workers[i].thread, NULL);
+    }
+#endif
 
     return 0;
 }
-
@@ -69,6 +69,14 @@
 // line2        the line of the end of the token
 // column2      the column of the end of the token
 //
+// The input isn't read all at once. read_file() sets up the input, and lex()
+// reads it in chunks into a window (str) as it needs more, keeping the bytes of
+// the current token. So memory use is bounded by the chunk size and the longest
+// token, and stdin can be tokenized as it arrives. text is only valid until the
+// next call to lex(). A token is only accepted once the matcher didn't need to
+// look past the end of the window (m->hit_end), so chunk boundaries don't change
+// what gets matched.
+//
 
 #include "rx.h"
 #include "hash.h"
@@ -125,6 +133,13 @@ char *node_types[] = {
     "CHAR_SET",
     "GROUP_START",
     "GROUP_END",
+    "TAKE_NOCASE",
+    "SPAN",
+    "SPAN_LAZY",
+    "ATOMIC_START",
+    "ATOMIC_END",
+    "COUNT_START",
+    "COUNT",
 };
 
 char *char_set_types[] = {
@@ -291,6 +306,20 @@ void output_file (char *file, char *file2) {
         hash_insert(node_index, n, (void *) (long) i);
     }
 
+    // The matcher goes by the bitmap and intervals rx_init() worked out for
+    // each class.
+    for (i = 0; i < lex_rx->char_classes_count; i += 1) {
+        char_class_t *c = lex_rx->char_classes[i];
+        if (!c->intervals_count) {
+            continue;
+        }
+        fprintf(fp, "unsigned int char_class_intervals_%d[] = {", i);
+        for (int j = 0; j < 2 * c->intervals_count; j += 1) {
+            fprintf(fp, "%s0x%06x", j ? ", " : "", c->intervals[j]);
+        }
+        fprintf(fp, "};\n");
+    }
+
     fprintf(fp, "char_class_t char_classes[] = {\n");
     for (i = 0; i < lex_rx->char_classes_count; i += 1) {
         char_class_t *c = lex_rx->char_classes[i];
@@ -301,19 +330,37 @@ void output_file (char *file, char *file2) {
         print_string_escaped(fp, c->ranges_count, c->ranges);
         fprintf(fp, ", %3d, ", c->char_sets_count);
         print_string_escaped(fp, c->char_sets_count, c->char_sets);
-        fprintf(fp, "},\n");
+        fprintf(fp, ", 0, NULL, %d,\n        {", c->fold);
+        for (int j = 0; j < 32; j += 1) {
+            fprintf(fp, "%s0x%02x", j ? ", " : "", c->bytes[j]);
+        }
+        if (c->intervals_count) {
+            fprintf(fp, "},\n        %d, char_class_intervals_%d},\n", c->intervals_count, i);
+        } else {
+            fprintf(fp, "},\n        0, NULL},\n");
+        }
     }
     if (i == 0) {
         fprintf(fp, "    {0, 0, NULL, 0, NULL, 0, NULL},\n");
     }
     fprintf(fp, "};\n\n");
 
+    fprintf(fp, "quantifier_t counters[] = {\n");
+    for (i = 0; i < lex_rx->counters_count; i += 1) {
+        quantifier_t *q = lex_rx->counters + i;
+        fprintf(fp, "    {%5d, %5d, %d, %d},\n", q->min, q->max, q->greedy, q->possessive);
+    }
+    if (i == 0) {
+        fprintf(fp, "    {0, 0, 0, 0},\n");
+    }
+    fprintf(fp, "};\n\n");
+
     fprintf(fp, "node_t nodes[] = {\n");
     for (i = 0; i < lex_rx->nodes_count; i += 1) {
         node_t *n = lex_rx->nodes[i];
         int next = (int) hash_lookup(node_index, n->next);
         fprintf(fp, "    {%12s, (node_t *) %5d, ", node_types[n->type], next);
-        if (n->type == TAKE) {
+        if (n->type == TAKE || n->type == TAKE_NOCASE) {
             if (n->value == '\n') {
                 fprintf(fp, "      '\\n'");
             } else if (n->value == '\r') {
@@ -329,7 +376,7 @@ void output_file (char *file, char *file2) {
             } else {
                 fprintf(fp, "    '\\x%02x'", n->value);
             }
-        } else if (n->type == BRANCH) {
+        } else if (n->type == BRANCH || n->type == SPAN || n->type == SPAN_LAZY) {
             int next2 = (int) hash_lookup(node_index, n->next2);
             fprintf(fp, "%10d", next2);
         } else if (n->type == CHAR_SET) {
@@ -364,9 +411,14 @@ void output_file (char *file, char *file2) {
 
     fprintf(fp, "rx_t *rx;\n");
     fprintf(fp, "matcher_t *m;\n");
+    fprintf(fp, "int input_fd = -1;\n");
+    fprintf(fp, "int input_opened;\n");
+    fprintf(fp, "int input_eof = 1;\n");
+    fprintf(fp, "int chunk_size = 16384;\n");
     fprintf(fp, "int str_allocated;\n");
     fprintf(fp, "int str_size;\n");
     fprintf(fp, "char *str;\n");
+    fprintf(fp, "int str_offset;\n");
     fprintf(fp, "int pos = 0;\n");
     fprintf(fp, "int line = 1;\n");
     fprintf(fp, "int column = 1;\n");
@@ -378,50 +430,72 @@ void output_file (char *file, char *file2) {
     fprintf(fp, "int rule;\n");
     fprintf(fp, "#define BEGIN(n) rx->start = start_nodes[n]\n\n");
 
+    fprintf(fp, "// Sets up the input for lex(). Either give it an open fd, or -1 and the name\n");
+    fprintf(fp, "// of a file to open. Nothing is read yet, lex() reads the input in chunks\n");
+    fprintf(fp, "// as it needs them.\n");
     fprintf(fp, "int read_file (int fd, char *file) {\n");
-    fprintf(fp, "    str_size = 0;\n");
-    fprintf(fp, "    int opened = 0;\n");
+    fprintf(fp, "    if (input_opened) {\n");
+    fprintf(fp, "        close(input_fd);\n");
+    fprintf(fp, "        input_opened = 0;\n");
+    fprintf(fp, "    }\n");
     fprintf(fp, "    if (fd == -1) {\n");
     fprintf(fp, "        fd = open(file, O_RDONLY);\n");
     fprintf(fp, "        if (fd < 0) {\n");
     fprintf(fp, "            fprintf(stderr, \"Can't open %%s: %%s\\n\", file, strerror(errno));\n");
     fprintf(fp, "            return 0;\n");
     fprintf(fp, "        }\n");
-    fprintf(fp, "        opened = 1;\n");
+    fprintf(fp, "        input_opened = 1;\n");
     fprintf(fp, "    }\n");
-    fprintf(fp, "    int chunk_size = 16384;\n");
     fprintf(fp, "    if (str_allocated == 0) {\n");
     fprintf(fp, "        str_allocated = 2 * chunk_size;\n");
     fprintf(fp, "        str = malloc(str_allocated);\n");
     fprintf(fp, "    }\n");
-    fprintf(fp, "    int retval;\n");
-    fprintf(fp, "    while (1) {\n");
-    fprintf(fp, "        if (str_size + chunk_size > str_allocated) {\n");
-    fprintf(fp, "            str_allocated *= 2;\n");
-    fprintf(fp, "            str = realloc(str, str_allocated);\n");
-    fprintf(fp, "        }\n");
-    fprintf(fp, "        retval = read(fd, str + str_size, chunk_size);\n");
-    fprintf(fp, "        if (retval < 0) {\n");
-    fprintf(fp, "            fprintf(stderr, \"Can't read file: %%s\\n\", strerror(errno));\n");
-    fprintf(fp, "            return 0;\n");
-    fprintf(fp, "        } else if (retval == 0) {\n");
-    fprintf(fp, "            break;\n");
-    fprintf(fp, "        } else {\n");
-    fprintf(fp, "            str_size += retval;\n");
-    fprintf(fp, "        }\n");
+    fprintf(fp, "    input_fd = fd;\n");
+    fprintf(fp, "    input_eof = 0;\n");
+    fprintf(fp, "    str_size = 0;\n");
+    fprintf(fp, "    str_offset = 0;\n");
+    fprintf(fp, "    pos = pos2 = 0;\n");
+    fprintf(fp, "    line = line2 = 1;\n");
+    fprintf(fp, "    column = column2 = 1;\n");
+    fprintf(fp, "    return 1;\n");
+    fprintf(fp, "}\n\n");
+
+    fprintf(fp, "// str is a window into the input, str_offset is the input position of its\n");
+    fprintf(fp, "// first byte. This drops everything before the current token and reads the\n");
+    fprintf(fp, "// next chunk after it. The window only grows when a token doesn't fit in it.\n");
+    fprintf(fp, "int fill_buffer () {\n");
+    fprintf(fp, "    int keep = pos - str_offset;\n");
+    fprintf(fp, "    if (keep > 0) {\n");
+    fprintf(fp, "        memmove(str, str + keep, str_size - keep);\n");
+    fprintf(fp, "        str_size -= keep;\n");
+    fprintf(fp, "        str_offset = pos;\n");
     fprintf(fp, "    }\n");
-    fprintf(fp, "    if (opened) {\n");
-    fprintf(fp, "        close(fd);\n");
+    fprintf(fp, "    if (str_size + chunk_size > str_allocated) {\n");
+    fprintf(fp, "        str_allocated *= 2;\n");
+    fprintf(fp, "        str = realloc(str, str_allocated);\n");
+    fprintf(fp, "    }\n");
+    fprintf(fp, "    int retval = read(input_fd, str + str_size, chunk_size);\n");
+    fprintf(fp, "    if (retval < 0) {\n");
+    fprintf(fp, "        fprintf(stderr, \"Can't read file: %%s\\n\", strerror(errno));\n");
+    fprintf(fp, "        return 0;\n");
+    fprintf(fp, "    } else if (retval == 0) {\n");
+    fprintf(fp, "        input_eof = 1;\n");
+    fprintf(fp, "        if (input_opened) {\n");
+    fprintf(fp, "            close(input_fd);\n");
+    fprintf(fp, "            input_opened = 0;\n");
+    fprintf(fp, "        }\n");
+    fprintf(fp, "    } else {\n");
+    fprintf(fp, "        str_size += retval;\n");
     fprintf(fp, "    }\n");
     fprintf(fp, "    return 1;\n");
     fprintf(fp, "}\n\n");
 
     fprintf(fp, "int lex_init () {\n");
-    fprintf(fp, "    rx = calloc(1, sizeof(rx_t));\n");
+    fprintf(fp, "    rx = rx_alloc();\n");
     fprintf(fp, "    m = rx_matcher_alloc();\n");
     fprintf(fp, "    int nodes_count = sizeof(nodes) / sizeof(nodes[0]);\n");
     fprintf(fp, "    rx->nodes_count = nodes_count;\n");
-    fprintf(fp, "    rx->nodes = malloc(nodes_count * sizeof(node_t *));\n");
+    fprintf(fp, "    rx->nodes = realloc(rx->nodes, nodes_count * sizeof(node_t *));\n");
     fprintf(fp, "    int i;\n");
     fprintf(fp, "    for (i = 0; i < nodes_count; i += 1) {\n");
     fprintf(fp, "        node_t *n = nodes + i;\n");
@@ -429,12 +503,14 @@ void output_file (char *file, char *file2) {
     fprintf(fp, "        if (n->type != MATCH_END) {\n");
     fprintf(fp, "            n->next = nodes + (int) n->next;\n");
     fprintf(fp, "        }\n");
-    fprintf(fp, "        if (n->type == BRANCH) {\n");
+    fprintf(fp, "        if (n->type == BRANCH || n->type == SPAN || n->type == SPAN_LAZY) {\n");
     fprintf(fp, "            n->next2 = nodes + (int) n->next2;\n");
     fprintf(fp, "        } else if (n->type == CHAR_CLASS) {\n");
     fprintf(fp, "            n->ccval = char_classes + n->value;\n");
     fprintf(fp, "        }\n");
     fprintf(fp, "    }\n");
+    fprintf(fp, "    rx->counters_count = %d;\n", lex_rx->counters_count);
+    fprintf(fp, "    rx->counters = counters;\n");
     fprintf(fp, "    BEGIN(INITIAL);\n");
     fprintf(fp, "    return 1;\n");
     fprintf(fp, "}\n\n");
@@ -447,9 +523,18 @@ void output_file (char *file, char *file2) {
     fprintf(fp, "        pos = pos2;\n");
     fprintf(fp, "        line = line2;\n");
     fprintf(fp, "        column = column2;\n");
-    fprintf(fp, "        rx_match(rx, m, str_size, str, pos);\n");
+    fprintf(fp, "        while (1) {\n");
+    fprintf(fp, "            rx_match(rx, m, str_size, str, pos - str_offset);\n");
+    fprintf(fp, "            if (input_eof || !m->hit_end) {\n");
+    fprintf(fp, "                break;\n");
+    fprintf(fp, "            }\n");
+    fprintf(fp, "            // The token might continue past the end of what's been read\n");
+    fprintf(fp, "            if (!fill_buffer()) {\n");
+    fprintf(fp, "                return 0;\n");
+    fprintf(fp, "            }\n");
+    fprintf(fp, "        }\n");
     fprintf(fp, "        if (!m->success) {\n");
-    fprintf(fp, "            if (pos == str_size) {\n");
+    fprintf(fp, "            if (pos - str_offset == str_size) {\n");
     fprintf(fp, "                return 0;\n");
     fprintf(fp, "            } else {\n");
     fprintf(fp, "                fprintf(stderr, \"token not found.\\n\");\n");
@@ -458,7 +543,7 @@ void output_file (char *file, char *file2) {
     fprintf(fp, "        }\n");
     fprintf(fp, "        pos2 += m->cap_size[0];\n");
     fprintf(fp, "        for (int i = pos; i < pos2; i += 1) {\n");
-    fprintf(fp, "            if (str[i] == '\\n') {\n");
+    fprintf(fp, "            if (str[i - str_offset] == '\\n') {\n");
     fprintf(fp, "                line2 += 1;\n");
     fprintf(fp, "                column2 = 1;\n");
     fprintf(fp, "            } else {\n");
@@ -0,0 +1,276 @@
+// This file was generated from example6b.lx
+
+#include "rx.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#ifndef _WIN32
+    #include <unistd.h>
+#endif
+
+// This program is an example of a lexical scanner for a calculator. It detects
+// numbers and operators and ignores comments and whitespace.
+
+int value;
+
+
+char_class_t char_classes[] = {
+    {  0,   3, " \t\n",   0, NULL,   0, NULL, 0, NULL, 0,
+        {0x00, 0x06, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00},
+        0, NULL},
+};
+
+quantifier_t counters[] = {
+    {0, 0, 0, 0},
+};
+
+node_t nodes[] = {
+    {   ASSERTION, (node_t *)     1, ASSERT_SOP},
+    {      BRANCH, (node_t *)    29,         30},
+    {        SPAN, (node_t *)     3,          5},
+    {      BRANCH, (node_t *)     4,          5},
+    {    CHAR_SET, (node_t *)     3,   CS_NOTNL},
+    {        TAKE, (node_t *)     6,       '\n'},
+    {   MATCH_END, (node_t *)     0,          0},
+    {        TAKE, (node_t *)     2,        '#'},
+    {        SPAN, (node_t *)    11,         10},
+    {      BRANCH, (node_t *)    11,         10},
+    {   MATCH_END, (node_t *)     0,          1},
+    {    CHAR_SET, (node_t *)     9,   CS_DIGIT},
+    {      BRANCH, (node_t *)     7,          8},
+    {        TAKE, (node_t *)    14,        '*'},
+    {   MATCH_END, (node_t *)     0,          2},
+    {      BRANCH, (node_t *)    12,         13},
+    {        TAKE, (node_t *)    17,        '/'},
+    {   MATCH_END, (node_t *)     0,          3},
+    {      BRANCH, (node_t *)    15,         16},
+    {        TAKE, (node_t *)    20,        '+'},
+    {   MATCH_END, (node_t *)     0,          4},
+    {      BRANCH, (node_t *)    18,         19},
+    {        TAKE, (node_t *)    23,        '-'},
+    {   MATCH_END, (node_t *)     0,          5},
+    {      BRANCH, (node_t *)    21,         22},
+    {        SPAN, (node_t *)    28,         27},
+    {      BRANCH, (node_t *)    28,         27},
+    {   MATCH_END, (node_t *)     0,          6},
+    {  CHAR_CLASS, (node_t *)    26,          0},
+    {      BRANCH, (node_t *)    24,         25},
+    {    CHAR_SET, (node_t *)    31,     CS_ANY},
+    {   MATCH_END, (node_t *)     0,          7},
+};
+
+enum start_node_t {
+    INITIAL,
+};
+
+node_t *start_nodes[] = {
+    nodes + 0,
+};
+
+rx_t *rx;
+matcher_t *m;
+int input_fd = -1;
+int input_opened;
+int input_eof = 1;
+int chunk_size = 16384;
+int str_allocated;
+int str_size;
+char *str;
+int str_offset;
+int pos = 0;
+int line = 1;
+int column = 1;
+int pos2 = 0;
+int line2 = 1;
+int column2 = 1;
+int text_size;
+char *text;
+int rule;
+#define BEGIN(n) rx->start = start_nodes[n]
+
+// Sets up the input for lex(). Either give it an open fd, or -1 and the name
+// of a file to open. Nothing is read yet, lex() reads the input in chunks
+// as it needs them.
+int read_file (int fd, char *file) {
+    if (input_opened) {
+        close(input_fd);
+        input_opened = 0;
+    }
+    if (fd == -1) {
+        fd = open(file, O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "Can't open %s: %s\n", file, strerror(errno));
+            return 0;
+        }
+        input_opened = 1;
+    }
+    if (str_allocated == 0) {
+        str_allocated = 2 * chunk_size;
+        str = malloc(str_allocated);
+    }
+    input_fd = fd;
+    input_eof = 0;
+    str_size = 0;
+    str_offset = 0;
+    pos = pos2 = 0;
+    line = line2 = 1;
+    column = column2 = 1;
+    return 1;
+}
+
+// str is a window into the input, str_offset is the input position of its
+// first byte. This drops everything before the current token and reads the
+// next chunk after it. The window only grows when a token doesn't fit in it.
+int fill_buffer () {
+    int keep = pos - str_offset;
+    if (keep > 0) {
+        memmove(str, str + keep, str_size - keep);
+        str_size -= keep;
+        str_offset = pos;
+    }
+    if (str_size + chunk_size > str_allocated) {
+        str_allocated *= 2;
+        str = realloc(str, str_allocated);
+    }
+    int retval = read(input_fd, str + str_size, chunk_size);
+    if (retval < 0) {
+        fprintf(stderr, "Can't read file: %s\n", strerror(errno));
+        return 0;
+    } else if (retval == 0) {
+        input_eof = 1;
+        if (input_opened) {
+            close(input_fd);
+            input_opened = 0;
+        }
+    } else {
+        str_size += retval;
+    }
+    return 1;
+}
+
+int lex_init () {
+    rx = rx_alloc();
+    m = rx_matcher_alloc();
+    int nodes_count = sizeof(nodes) / sizeof(nodes[0]);
+    rx->nodes_count = nodes_count;
+    rx->nodes = realloc(rx->nodes, nodes_count * sizeof(node_t *));
+    int i;
+    for (i = 0; i < nodes_count; i += 1) {
+        node_t *n = nodes + i;
+        rx->nodes[i] = n;
+        if (n->type != MATCH_END) {
+            n->next = nodes + (int) n->next;
+        }
+        if (n->type == BRANCH || n->type == SPAN || n->type == SPAN_LAZY) {
+            n->next2 = nodes + (int) n->next2;
+        } else if (n->type == CHAR_CLASS) {
+            n->ccval = char_classes + n->value;
+        }
+    }
+    rx->counters_count = 0;
+    rx->counters = counters;
+    BEGIN(INITIAL);
+    return 1;
+}
+
+int lex () {
+    while (1) {
+        pos = pos2;
+        line = line2;
+        column = column2;
+        while (1) {
+            rx_match(rx, m, str_size, str, pos - str_offset);
+            if (input_eof || !m->hit_end) {
+                break;
+            }
+            // The token might continue past the end of what's been read
+            if (!fill_buffer()) {
+                return 0;
+            }
+        }
+        if (!m->success) {
+            if (pos - str_offset == str_size) {
+                return 0;
+            } else {
+                fprintf(stderr, "token not found.\n");
+                return 0;
+            }
+        }
+        pos2 += m->cap_size[0];
+        for (int i = pos; i < pos2; i += 1) {
+            if (str[i - str_offset] == '\n') {
+                line2 += 1;
+                column2 = 1;
+            } else {
+                column2 += 1;
+            }
+        }
+        rule = m->value;
+        text_size = m->cap_size[0];
+        text = m->cap_str[0];
+        switch (rule) {
+        case 0:
+    // comment
+
+        break;
+
+        case 1:
+    value = atoi(text);
+    printf("found a number %d\n", value);
+
+        break;
+
+        case 2:
+    printf("found * operator\n");
+
+        break;
+
+        case 3:
+    printf("found / operator\n");
+
+        break;
+
+        case 4:
+    printf("found + operator\n");
+
+        break;
+
+        case 5:
+    printf("found - operator\n");
+
+        break;
+
+        case 6:
+    // whitespace
+
+        break;
+
+        case 7:
+    printf("Unexpected character \"%c\" at line %d column %d\n", *text, line, column);
+    exit(1);
+
+
+        break;
+
+        }
+    }
+    return 0;
+}
+
+
+int main (int argc, char **argv) {
+    if (argc < 2) {
+        read_file(-1, "example6b.txt");
+    } else {
+        read_file(-1, argv[1]);
+    }
+
+    lex_init();
+    while (lex()) {
+        // ok
+    }
+}
+
+
@@ -8,6 +8,73 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define RX_X86 1
+#include <immintrin.h>
+#endif
+
+typedef struct glushkov_t glushkov_t;
+typedef struct onepass_t onepass_t;
+typedef struct tdfa_t tdfa_t;
+typedef struct reverse_t reverse_t;
+typedef struct runs_t runs_t;
+typedef struct dispatch_t dispatch_t;
+typedef struct scans_t scans_t;
+typedef struct literals_t literals_t;
+typedef struct memo_layout_t memo_layout_t;
+
+// The parts of an rx_t that only rx.c looks at, filled in by rx_init().
+struct rx_internal_t {
+    int *group_first;
+    char *group_ignorecase;
+    int prefix_size;
+    char *prefix;
+    char *prefix_fold;
+    int prefix_nocase;
+    glushkov_t *glushkov;
+    onepass_t *onepass;
+    tdfa_t *tdfa;
+    reverse_t *reverse;
+    runs_t *runs;
+    dispatch_t *dispatch;
+    scans_t *scans;
+    literals_t *literals;
+    unsigned char *empty_loops;
+    memo_layout_t *memo_layout;
+};
+
+// Where the backtracker was when its step quantum ran out, so
+// rx_match_resume() can go on from there.
+typedef struct {
+    node_t *node;
+    int pos;
+    int start_pos;
+    long backtracks;
+    long backtracks_allowed;
+    int memoized;
+    int memo_counted;
+    int memo_start;
+    int memo_width;
+    int memo_sop;
+    long long usec;
+} resume_t;
+
+// The parts of a matcher_t that only rx.c looks at, kept between matches.
+struct matcher_internal_t {
+    int regs_allocated;
+    int *regs;
+    int memo_allocated;
+    unsigned char *memo;
+    int counters_allocated;
+    int *counters;
+    resume_t resume;
+};
 
 // Reads a utf8 character from str and determines how many bytes it is. If the str
 // doesn't contain a proper utf8 character, it returns 1. str needs to have at
@@ -89,6 +156,11 @@ node_t *rx_node_create (rx_t *rx) {
     node_t *n = malloc(sizeof(node_t));
     n->type = EMPTY;
     n->next = NULL;
+    n->index = rx->nodes_count;
+    // Where in the regexp it's from, which the parser sets for the node each
+    // part of the regexp starts at. The ones made along the way are near the
+    // one made before them.
+    n->pos = rx->nodes_count ? rx->nodes[rx->nodes_count - 1]->pos : 0;
     if (rx->nodes_count >= rx->nodes_allocated) {
         rx->nodes_allocated *= 2;
         rx->nodes = realloc(rx->nodes, rx->nodes_allocated * sizeof(node_t *));
@@ -157,6 +229,8 @@ void rx_print (rx_t *rx) {
                 label[1] = '\0';
             }
             fprintf(fp, "    %d -> %d [label=\"%s\",style=solid]\n", i1, i2, label);
+        } else if (n->type == TAKE_NOCASE) {
+            fprintf(fp, "    %d -> %d [label=\"%c%c\",style=solid]\n", i1, i2, n->value, n->value & ~0x20);
         } else if (n->type == CAPTURE_START) {
             fprintf(fp, "    %d -> %d [label=\"(%d\",style=solid]\n", i1, i2, n->value);
         } else if (n->type == CAPTURE_END) {
@@ -165,11 +239,25 @@ void rx_print (rx_t *rx) {
             fprintf(fp, "    %d -> %d [label=\"(?\",style=solid]\n", i1, i2);
         } else if (n->type == GROUP_END) {
             fprintf(fp, "    %d -> %d [label=\")?\",style=solid]\n", i1, i2);
+        } else if (n->type == ATOMIC_START) {
+            fprintf(fp, "    %d -> %d [label=\"(>\",style=solid]\n", i1, i2);
+        } else if (n->type == ATOMIC_END) {
+            fprintf(fp, "    %d -> %d [label=\")>\",style=solid]\n", i1, i2);
+        } else if (n->type == COUNT_START) {
+            fprintf(fp, "    %d -> %d [label=\"#%d=0\",style=solid]\n", i1, i2, n->value);
+        } else if (n->type == COUNT) {
+            quantifier_t *qval = rx->counters + n->value;
+            fprintf(fp, "    %d -> %d [label=\"#%d{%d,%d}\",style=solid]\n", i1, i2, n->value, qval->min, qval->max);
         } else if (n->type == BRANCH) {
             int i3 = rx_node_index(rx, n->next2);
             fprintf(fp, "    %d [label=\"%dB\"]\n", i1, i1);
             fprintf(fp, "    %d -> %d [style=solid]\n", i1, i2);
             fprintf(fp, "    %d -> %d [style=dotted]\n", i1, i3);
+        } else if (n->type == SPAN || n->type == SPAN_LAZY) {
+            int i3 = rx_node_index(rx, n->next2);
+            fprintf(fp, "    %d [label=\"%dS%s\"]\n", i1, i1, n->type == SPAN_LAZY ? "?" : "");
+            fprintf(fp, "    %d -> %d [style=solid]\n", i1, i2);
+            fprintf(fp, "    %d -> %d [style=dotted]\n", i1, i3);
         } else if (n->type == ASSERTION) {
             fprintf(fp, "    %d [label=\"%dA\"]\n", i1, i1);
             char *labels[] = {
@@ -383,9 +471,138 @@ void char_class_free (char_class_t *ccval) {
     free(ccval->values);
     free(ccval->ranges);
     free(ccval->char_sets);
+    free(ccval->intervals);
     free(ccval);
 }
 
+// The characters in a class are compared by their number, which is the bits
+// of their utf8 encoding with the size above them, so a longer character is
+// always higher. For proper utf8 that's the same order as the codepoints. A
+// byte that isn't part of a proper utf8 character is a character by itself.
+static unsigned int rx_char_number (int size, char *str) {
+    unsigned char c = str[0];
+    unsigned int value = size == 1 ? c : size == 2 ? c & 0x1f : size == 3 ? c & 0x0f : c & 0x07;
+    for (int i = 1; i < size; i += 1) {
+        value = (value << 6) | (str[i] & 0x3f);
+    }
+    return ((unsigned int) (size - 1) << 21) | value;
+}
+
+// The number of the first character more than a byte long, and one more than
+// the highest number.
+#define RX_CHAR_MULTIBYTE (1 << 21)
+#define RX_CHAR_END (4 << 21)
+
+static int rx_interval_compare (const void *a, const void *b) {
+    unsigned int a2 = *(unsigned int *) a;
+    unsigned int b2 = *(unsigned int *) b;
+    return a2 < b2 ? -1 : a2 > b2;
+}
+
+static int rx_match_char_set (int type, unsigned char c);
+
+// Works out what a character class matches from its values, ranges and sets.
+// The characters that are a single byte go in a bitmap. The longer ones are a
+// sorted list of intervals of their numbers, each a low and high pair, with the
+// ones that overlap or touch merged. Both already have the class being negated
+// in them.
+static void rx_char_class_compile (char_class_t *ccval) {
+    memset(ccval->bytes, 0, 32);
+    int allocated = ccval->values_count + ccval->ranges_count + ccval->char_sets_count + 1;
+    unsigned int *intervals = malloc(2 * allocated * sizeof(unsigned int));
+    int count = 0;
+
+    for (int i = 0; i < ccval->values_count;) {
+        int char1_size = rx_utf8_char_size(ccval->values_count, ccval->values, i);
+        unsigned int n = rx_char_number(char1_size, ccval->values + i);
+        if (n < RX_CHAR_MULTIBYTE) {
+            ccval->bytes[n >> 3] |= 1 << (n & 7);
+        } else {
+            intervals[2 * count] = n;
+            intervals[2 * count + 1] = n;
+            count += 1;
+        }
+        i += char1_size;
+    }
+
+    for (int i = 0; i < ccval->ranges_count;) {
+        int char1_size = rx_utf8_char_size(ccval->ranges_count, ccval->ranges, i);
+        unsigned int lo = rx_char_number(char1_size, ccval->ranges + i);
+        i += char1_size;
+        int char2_size = rx_utf8_char_size(ccval->ranges_count, ccval->ranges, i);
+        unsigned int hi = rx_char_number(char2_size, ccval->ranges + i);
+        i += char2_size;
+        for (unsigned int n = lo; n <= hi && n < 256; n += 1) {
+            ccval->bytes[n >> 3] |= 1 << (n & 7);
+        }
+        if (hi >= RX_CHAR_MULTIBYTE) {
+            intervals[2 * count] = lo > RX_CHAR_MULTIBYTE ? lo : RX_CHAR_MULTIBYTE;
+            intervals[2 * count + 1] = hi;
+            count += 1;
+        }
+    }
+
+    // The sets only look at the first byte, so the ones that match any byte
+    // that starts a longer character match all of those.
+    int multibyte = 0;
+    for (int i = 0; i < ccval->char_sets_count; i += 1) {
+        for (int c = 0; c < 256; c += 1) {
+            if (rx_match_char_set(ccval->char_sets[i], c)) {
+                ccval->bytes[c >> 3] |= 1 << (c & 7);
+            }
+        }
+        multibyte |= rx_match_char_set(ccval->char_sets[i], 0xc0);
+    }
+    if (multibyte) {
+        intervals[2 * count] = RX_CHAR_MULTIBYTE;
+        intervals[2 * count + 1] = RX_CHAR_END - 1;
+        count += 1;
+    }
+
+    qsort(intervals, count, 2 * sizeof(unsigned int), rx_interval_compare);
+    int merged = 0;
+    for (int i = 0; i < count; i += 1) {
+        if (merged && intervals[2 * i] <= intervals[2 * merged - 1] + 1) {
+            if (intervals[2 * i + 1] > intervals[2 * merged - 1]) {
+                intervals[2 * merged - 1] = intervals[2 * i + 1];
+            }
+            continue;
+        }
+        intervals[2 * merged] = intervals[2 * i];
+        intervals[2 * merged + 1] = intervals[2 * i + 1];
+        merged += 1;
+    }
+    count = merged;
+
+    if (ccval->negated) {
+        for (int i = 0; i < 32; i += 1) {
+            ccval->bytes[i] ^= 0xff;
+        }
+        // The gaps between the intervals, there's at most one more of those.
+        unsigned int *gaps = malloc(2 * (count + 1) * sizeof(unsigned int));
+        unsigned int lo = RX_CHAR_MULTIBYTE;
+        int gaps_count = 0;
+        for (int i = 0; i <= count; i += 1) {
+            unsigned int hi = i < count ? intervals[2 * i] : RX_CHAR_END;
+            if (lo < hi) {
+                gaps[2 * gaps_count] = lo;
+                gaps[2 * gaps_count + 1] = hi - 1;
+                gaps_count += 1;
+            }
+            if (i < count) {
+                lo = intervals[2 * i + 1] + 1;
+            }
+        }
+        free(intervals);
+        intervals = gaps;
+        count = gaps_count;
+    }
+
+    free(ccval->intervals);
+    ccval->intervals = intervals;
+    ccval->intervals_count = count;
+}
+
 // This construct is character oriented. If you write [☃], it will match the 3
 // byte sequence \xe2\e98\x83, and not individual bytes in that sequnce. Similarly,
 // if you specify a range like [Α-Ω], Greek alpha to omega, it will match only
@@ -434,6 +651,7 @@ int rx_char_class_init (rx_t *rx, int pos, int *pos2, char_class_t **ccval2) {
 
     // Fill in the arrays.
     rx_char_class_parse(rx, pos, &pos, 1, ccval);
+    rx_char_class_compile(ccval);
     ccval->str_size = regexp + pos - ccval->str + 1;
     if (rx->char_classes_count >= rx->char_classes_allocated) {
         rx->char_classes_allocated *= 2;
@@ -451,7 +669,7 @@ int rx_quantifier_init (rx_t *rx, int pos, int *pos2, quantifier_t *qval) {
     int regexp_size = rx->regexp_size;
     char *regexp = rx->regexp;
     char c;
-    int min = 0, seen_min = 0, max = 0, seen_max = 0, greedy = 1;
+    int min = 0, seen_min = 0, max = 0, seen_max = 0, greedy = 1, possessive = 0;
     pos += 1;
     for (; pos < regexp_size; pos += 1) {
         c = regexp[pos];
@@ -497,6 +715,11 @@ int rx_quantifier_init (rx_t *rx, int pos, int *pos2, quantifier_t *qval) {
         pos += 1;
         greedy = 0;
     }
+    else if (c == '+') {
+        // possessive
+        pos += 1;
+        possessive = 1;
+    }
     else {
         // greedy
         greedy = 1;
@@ -504,10 +727,19 @@ int rx_quantifier_init (rx_t *rx, int pos, int *pos2, quantifier_t *qval) {
     qval->min = min;
     qval->max = max;
     qval->greedy = greedy;
+    qval->possessive = possessive;
     *pos2 = pos;
     return 1;
 }
 
+static void rx_onepass_free (onepass_t *op);
+static void rx_tdfa_free (tdfa_t *t);
+static void rx_reverse_free (reverse_t *r);
+static void rx_runs_free (runs_t *runs);
+static void rx_dispatch_free (dispatch_t *d);
+static void rx_scans_free (scans_t *s);
+static void rx_memo_layout_free (memo_layout_t *ml);
+
 static void rx_partial_free (rx_t *rx) {
     int i;
     for (i = 0; i < rx->nodes_count; i += 1) {
@@ -520,9 +752,40 @@ static void rx_partial_free (rx_t *rx) {
         char_class_free(c);
     }
     rx->char_classes_count = 0;
+    rx->counters_count = 0;
     rx->error = 0;
     rx->cap_count = 0;
-    rx->ignorecase = 0;
+    rx->internal->prefix_size = 0;
+    rx->internal->prefix_nocase = 0;
+    free(rx->internal->glushkov);
+    rx->internal->glushkov = NULL;
+    rx_onepass_free(rx->internal->onepass);
+    rx->internal->onepass = NULL;
+    rx_tdfa_free(rx->internal->tdfa);
+    rx->internal->tdfa = NULL;
+    rx_reverse_free(rx->internal->reverse);
+    rx->internal->reverse = NULL;
+    rx_runs_free(rx->internal->runs);
+    rx->internal->runs = NULL;
+    rx_dispatch_free(rx->internal->dispatch);
+    rx->internal->dispatch = NULL;
+    rx_scans_free(rx->internal->scans);
+    rx->internal->scans = NULL;
+    free(rx->internal->literals);
+    rx->internal->literals = NULL;
+    free(rx->internal->empty_loops);
+    rx->internal->empty_loops = NULL;
+    rx_memo_layout_free(rx->internal->memo_layout);
+    rx->internal->memo_layout = NULL;
+    rx->complexity = COMPLEXITY_UNKNOWN;
+    rx->complexity_degree = 0;
+    rx->complexity_pos = 0;
+    rx->complexity_size = 0;
+    free(rx->complexitystr);
+    rx->complexitystr = NULL;
+    char *suffix = rx->plan.suffix;
+    memset(&rx->plan, 0, sizeof(plan_t));
+    rx->plan.suffix = suffix;
 }
 
 void rx_free (rx_t *rx) {
@@ -532,13 +795,21 @@ void rx_free (rx_t *rx) {
     free(rx->cap_start);
     free(rx->or_end);
     free(rx->char_classes);
+    free(rx->counters);
     free(rx->dfs_stack);
     free(rx->errorstr);
+    free(rx->plan.suffix);
+    free(rx->internal->group_first);
+    free(rx->internal->group_ignorecase);
+    free(rx->internal->prefix);
+    free(rx->internal->prefix_fold);
+    free(rx->internal);
     free(rx);
 }
 
 rx_t *rx_alloc () {
     rx_t *rx = calloc(1, sizeof(rx_t));
+    rx->internal = calloc(1, sizeof(rx_internal_t));
     rx->nodes_allocated = 10;
     rx->nodes = malloc(rx->nodes_allocated * sizeof(node_t *));
     rx->char_classes_allocated = 10;
@@ -546,6 +817,8 @@ rx_t *rx_alloc () {
     rx->cap_allocated = 10;
     rx->cap_start = malloc(rx->cap_allocated * sizeof(node_t *));
     rx->or_end = malloc(rx->cap_allocated * sizeof(node_t *));
+    rx->internal->group_first = malloc(rx->cap_allocated * sizeof(int));
+    rx->internal->group_ignorecase = malloc(rx->cap_allocated * sizeof(char));
     rx->dfs_stack_allocated = 10;
     rx->dfs_stack = malloc(rx->dfs_stack_allocated * sizeof(node_t *));
     rx->dfs_map = hash_init(hash_direct_hash, hash_direct_equal);
@@ -554,6 +827,7 @@ rx_t *rx_alloc () {
 
 matcher_t *rx_matcher_alloc () {
     matcher_t *m = calloc(1, sizeof(matcher_t));
+    m->internal = calloc(1, sizeof(matcher_internal_t));
     m->path_allocated = 10;
     m->path = malloc(m->path_allocated * sizeof(path_t));
     m->cap_allocated = 10;
@@ -562,9 +836,97 @@ matcher_t *rx_matcher_alloc () {
     m->cap_defined = realloc(m->cap_defined, m->cap_allocated * sizeof(char));
     m->cap_str = realloc(m->cap_str, m->cap_allocated * sizeof(char *));
     m->cap_size = realloc(m->cap_size, m->cap_allocated * sizeof(int));
+    m->backtrack_limit = 32;
     return m;
 }
 
+// Adds the other case of the ascii letters to a character class, so it doesn't
+// have to be retried with the case flipped when matching.
+static void rx_char_class_fold (char_class_t *ccval) {
+    if (ccval->fold) {
+        return;
+    }
+    ccval->fold = 1;
+
+    int count = ccval->values_count;
+    char *values = malloc(2 * count + 1);
+    if (count) {
+        memcpy(values, ccval->values, count);
+    }
+    for (int i = 0; i < count;) {
+        int char1_size = rx_utf8_char_size(count, ccval->values, i);
+        unsigned char c = ccval->values[i];
+        if (char1_size == 1 && ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z'))) {
+            values[ccval->values_count] = c ^ 0x20;
+            ccval->values_count += 1;
+        }
+        i += char1_size;
+    }
+    values[ccval->values_count] = '\0';
+    free(ccval->values);
+    ccval->values = values;
+
+    // Each range is at least 2 bytes and adds at most 2 ranges of 2 bytes.
+    count = ccval->ranges_count;
+    char *ranges = malloc(3 * count + 1);
+    if (count) {
+        memcpy(ranges, ccval->ranges, count);
+    }
+    for (int i = 0; i < count;) {
+        int char1_size = rx_utf8_char_size(count, ccval->ranges, i);
+        unsigned char c1 = ccval->ranges[i];
+        i += char1_size;
+        int char2_size = rx_utf8_char_size(count, ccval->ranges, i);
+        unsigned char c2 = ccval->ranges[i];
+        i += char2_size;
+        if (char1_size != 1) {
+            continue;
+        }
+        if (char2_size != 1) {
+            c2 = 0x7f;
+        }
+        for (int j = 0; j < 2; j += 1) {
+            unsigned char lo = j ? 'a' : 'A';
+            unsigned char hi = j ? 'z' : 'Z';
+            lo = c1 > lo ? c1 : lo;
+            hi = c2 < hi ? c2 : hi;
+            if (lo <= hi) {
+                ranges[ccval->ranges_count] = lo ^ 0x20;
+                ranges[ccval->ranges_count + 1] = hi ^ 0x20;
+                ccval->ranges_count += 2;
+            }
+        }
+    }
+    ranges[ccval->ranges_count] = '\0';
+    free(ccval->ranges);
+    ccval->ranges = ranges;
+    rx_char_class_compile(ccval);
+}
+
+// Makes a node ignore case. TAKE nodes for letters become TAKE_NOCASE nodes
+// that store the lower case letter, since c | 0x20 is the lower case of c
+// when c is a letter.
+static void rx_fold_node (node_t *node) {
+    if (node->type == TAKE) {
+        int c = node->value;
+        if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z')) {
+            node->type = TAKE_NOCASE;
+            node->value = c | 0x20;
+        }
+    } else if (node->type == CHAR_CLASS) {
+        rx_char_class_fold(node->ccval);
+    }
+}
+
+// \c applies to the whole regexp, wherever it is in it, and (?i:...) only to
+// what's inside it. The nodes of a group are the ones created since it
+// started.
+static void rx_fold_nodes (rx_t *rx, int first) {
+    for (int i = first; i < rx->nodes_count; i += 1) {
+        rx_fold_node(rx->nodes[i]);
+    }
+}
+
 // Copies the subgraph starting at sg_start and going no furthur than sg_end into
 // the node starting at new_start. Returns the new_end node. Performs a depth first
 // search iteratively.
@@ -589,19 +951,20 @@ node_t *copy_subgraph (rx_t *rx, node_t *sg_start, node_t *sg_end, node_t *new_s
         new_node = hash_lookup(rx->dfs_map, node);
         if (node == sg_end) {
             new_end = new_node;
-            node->type |= 0x80; // visited
             continue;
         }
         *new_node = *node;
-        node->type |= 0x80; // visited
 
         if (rx->dfs_stack_count + 1 >= rx->dfs_stack_allocated) {
             rx->dfs_stack_allocated *= 2;
             rx->dfs_stack = realloc(rx->dfs_stack, rx->dfs_stack_allocated * sizeof(node_t *));
         }
 
-        if (node->next->type & 0x80) {
-            new_node->next = hash_lookup(rx->dfs_map, node->next);
+        // A node can be reached again before it's been copied, so look for the
+        // copy that was already made for it instead of checking if it's visited.
+        new_node2 = hash_lookup(rx->dfs_map, node->next);
+        if (new_node2) {
+            new_node->next = new_node2;
         } else {
             new_node2 = rx_node_create(rx);
             new_node->next = new_node2;
@@ -610,9 +973,10 @@ node_t *copy_subgraph (rx_t *rx, node_t *sg_start, node_t *sg_end, node_t *new_s
             rx->dfs_stack_count += 1;
         }
 
-        if (new_node->type == BRANCH) {
-            if (node->next2->type & 0x80) {
-                new_node->next2 = hash_lookup(rx->dfs_map, node->next2);
+        if (new_node->type == BRANCH || new_node->type == SPAN || new_node->type == SPAN_LAZY) {
+            new_node2 = hash_lookup(rx->dfs_map, node->next2);
+            if (new_node2) {
+                new_node->next2 = new_node2;
             } else {
                 new_node2 = rx_node_create(rx);
                 new_node->next2 = new_node2;
@@ -623,22 +987,109 @@ node_t *copy_subgraph (rx_t *rx, node_t *sg_start, node_t *sg_end, node_t *new_s
         }
     }
 
-    // Unset all the visited flags.
-    for (int i = 0; i < rx->dfs_map->allocated; i += 1) {
-        if (rx->dfs_map->defined[i]) {
-            node = rx->dfs_map->keys[i];
-            node->type &= ~0x80;
+    return new_end;
+}
+
+// Finds the literal string every match has to start with, by following the nodes
+// from the start up to the first one that could branch or doesn't take a fixed
+// character. rx_match() uses it to skip ahead to start positions where it occurs.
+static void rx_find_prefix (rx_t *rx) {
+    rx->internal->prefix_size = 0;
+    rx->internal->prefix_nocase = 0;
+    rx->internal->prefix = realloc(rx->internal->prefix, rx->nodes_count);
+    rx->internal->prefix_fold = realloc(rx->internal->prefix_fold, rx->nodes_count);
+    node_t *node = rx->start;
+    while (1) {
+        if (node->type == TAKE || node->type == TAKE_NOCASE) {
+            rx->internal->prefix[rx->internal->prefix_size] = node->value;
+            rx->internal->prefix_fold[rx->internal->prefix_size] = node->type == TAKE_NOCASE ? 0x20 : 0;
+            rx->internal->prefix_nocase |= node->type == TAKE_NOCASE;
+            rx->internal->prefix_size += 1;
+        } else if (node->type != EMPTY && node->type != GROUP_START &&
+                   node->type != GROUP_END && node->type != CAPTURE_START &&
+                   node->type != CAPTURE_END && node->type != ASSERTION &&
+                   node->type != SPAN && node->type != SPAN_LAZY &&
+                   node->type != ATOMIC_START && node->type != ATOMIC_END) {
+            break;
         }
+        node = node->next;
     }
+}
 
-    return new_end;
+// Makes the nodes from first up to last into an atomic group, for a possessive
+// quantifier. What was at first moves to after the ATOMIC_START that takes its
+// place, and last becomes the ATOMIC_END. Returns the node after that.
+static node_t *rx_atomic (rx_t *rx, node_t *first, node_t *last) {
+    if (first == last) {
+        // Nothing is repeated.
+        return last;
+    }
+    node_t *moved = rx_node_create(rx);
+    *moved = *first;
+    first->type = ATOMIC_START;
+    first->next = moved;
+    node_t *node2 = rx_node_create(rx);
+    last->type = ATOMIC_END;
+    last->next = node2;
+    return node2;
 }
 
+// The most nodes a {n,m} is copied out to, any more and it's a loop with a counter
+#define RX_UNROLL_MAX 128
+
+// Makes the nodes from first up to last into a loop that counts the times
+// around it, for a {n,m} with too big a count to copy the nodes out for each
+// time. first becomes the COUNT_START, which sets the counter, and what was
+// there moves to the start of the loop. last becomes the COUNT, which adds one
+// to the counter and goes back around until there's min, then goes to a branch
+// between going around again and leaving, until there's max. Returns the node
+// after the loop. The other engines don't know about counters, so a regexp
+// with one is always backtracked.
+static node_t *rx_counter (rx_t *rx, node_t *first, node_t *last, quantifier_t *qval) {
+    if (first == last) {
+        // Nothing is repeated.
+        return last;
+    }
+    if (rx->counters_count == rx->counters_allocated) {
+        rx->counters_allocated = rx->counters_allocated ? 2 * rx->counters_allocated : 4;
+        rx->counters = realloc(rx->counters, rx->counters_allocated * sizeof(quantifier_t));
+    }
+    rx->counters[rx->counters_count] = *qval;
+    node_t *body = rx_node_create(rx);
+    node_t *branch = rx_node_create(rx);
+    node_t *node2 = rx_node_create(rx);
+    *body = *first;
+    first->type = COUNT_START;
+    first->value = rx->counters_count;
+    first->next = last;
+    last->type = COUNT;
+    last->value = rx->counters_count;
+    last->next = branch;
+    branch->type = BRANCH;
+    branch->pos = last->pos;
+    if (qval->greedy) {
+        branch->next = body;
+        branch->next2 = node2;
+    } else {
+        branch->next = node2;
+        branch->next2 = body;
+    }
+    rx->counters_count += 1;
+    return node2;
+}
+
+static void rx_prepare (rx_t *rx);
+static int rx_node_consumes (node_t *node);
+
 // Returns 1 on success.
 int rx_init (rx_t *rx, int regexp_size, char *regexp) {
     rx_partial_free(rx);
     rx->start = rx_node_create(rx);
-    return rx_init_start(rx, regexp_size, regexp, rx->start, 0);
+    if (!rx_init_start(rx, regexp_size, regexp, rx->start, 0)) {
+        return 0;
+    }
+    rx_prepare(rx);
+    return 1;
 }
 
 int rx_init_start (rx_t *rx, int regexp_size, char *regexp, node_t *start, int value) {
@@ -650,14 +1101,28 @@ int rx_init_start (rx_t *rx, int regexp_size, char *regexp, node_t *start, int v
     node_t *or_end = NULL;
     int cap_depth = 0;
     int cap_count = 0;
+    int group_first = rx->nodes_count;
+    int ignorecase = 0;
+    int ignorecase_all = 0;
 
     for (int pos = 0; pos < regexp_size; pos += 1) {
         unsigned char c = regexp[pos];
+        node->pos = pos;
         if (c == '(') {
+            int nocase = 0;
             if (pos + 2 < regexp_size && regexp[pos + 1] == '?' && regexp[pos + 2] == ':') {
                 pos += 2;
                 node->type = GROUP_START;
             }
+            else if (pos + 3 < regexp_size && regexp[pos + 1] == '?' && regexp[pos + 2] == 'i' && regexp[pos + 3] == ':') {
+                pos += 3;
+                node->type = GROUP_START;
+                nocase = 1;
+            }
+            else if (pos + 2 < regexp_size && regexp[pos + 1] == '?' && regexp[pos + 2] == '>') {
+                pos += 2;
+                node->type = ATOMIC_START;
+            }
             else {
                 cap_count += 1;
                 node->value = cap_count;
@@ -669,10 +1134,16 @@ int rx_init_start (rx_t *rx, int regexp_size, char *regexp, node_t *start, int v
                 rx->cap_allocated *= 2;
                 rx->cap_start = realloc(rx->cap_start, rx->cap_allocated * sizeof(node_t *));
                 rx->or_end = realloc(rx->or_end, rx->cap_allocated * sizeof(node_t *));
+                rx->internal->group_first = realloc(rx->internal->group_first, rx->cap_allocated * sizeof(int));
+                rx->internal->group_ignorecase = realloc(rx->internal->group_ignorecase, rx->cap_allocated * sizeof(char));
             }
             rx->cap_start[cap_depth] = node;
             rx->or_end[cap_depth] = or_end;
+            rx->internal->group_first[cap_depth] = group_first;
+            rx->internal->group_ignorecase[cap_depth] = ignorecase;
             or_end = NULL;
+            group_first = rx->nodes_count - 1;
+            ignorecase = nocase;
             cap_depth += 1;
             atom_start = NULL;
             node = node2;
@@ -685,12 +1156,19 @@ int rx_init_start (rx_t *rx, int regexp_size, char *regexp, node_t *start, int v
                 node->next = or_end;
                 node = or_end;
             }
+            if (ignorecase) {
+                rx_fold_nodes(rx, group_first);
+            }
             cap_depth -= 1;
             or_end = rx->or_end[cap_depth];
+            group_first = rx->internal->group_first[cap_depth];
+            ignorecase = rx->internal->group_ignorecase[cap_depth];
             atom_start = rx->cap_start[cap_depth];
             node_t *node2 = rx_node_create(rx);
             if (atom_start->type == CAPTURE_START) {
                 node->type = CAPTURE_END;
+            } else if (atom_start->type == ATOMIC_START) {
+                node->type = ATOMIC_END;
             } else {
                 node->type = GROUP_END;
             }
@@ -699,14 +1177,14 @@ int rx_init_start (rx_t *rx, int regexp_size, char *regexp, node_t *start, int v
             node = node2;
 
         } else if (c == '|') {
-            node_t *node2 = rx_node_create(rx);
-            node_t *node3 = rx_node_create(rx);
             node_t *or_start;
             if (cap_depth) {
                 or_start = rx->cap_start[cap_depth - 1]->next;
             } else {
                 or_start = start;
             }
+            node_t *node2 = rx_node_create(rx);
+            node_t *node3 = rx_node_create(rx);
             *node2 = *or_start;
             or_start->type = BRANCH;
             or_start->next = node2;
@@ -716,6 +1194,7 @@ int rx_init_start (rx_t *rx, int regexp_size, char *regexp, node_t *start, int v
             } else {
                 or_end = node;
             }
+            atom_start = NULL;
             node = node3;
 
         } else if (c == '*') {
@@ -735,33 +1214,71 @@ int rx_init_start (rx_t *rx, int regexp_size, char *regexp, node_t *start, int v
                 atom_start->next2 = node2;
                 node->next = node3;
                 node->next2 = node2;
+                if (rx_node_consumes(node2) && node2->next == node) {
+                    atom_start->type = SPAN_LAZY;
+                    atom_start->next = node;
+                    atom_start->next2 = node3;
+                }
             } else {
                 // greedy
                 atom_start->next = node2;
                 atom_start->next2 = node3;
                 node->next = node2;
                 node->next2 = node3;
+                if (rx_node_consumes(node2) && node2->next == node) {
+                    // The backtracker takes a run of a single character all at
+                    // once with a span, everything else goes on into the loop.
+                    atom_start->type = SPAN;
+                    atom_start->next = node;
+                }
             }
             node = node3;
+            if (c2 == '+') {
+                // possessive
+                pos += 1;
+                node = rx_atomic(rx, atom_start, node);
+            }
 
         } else if (c == '+') {
             if (!atom_start) {
                 return rx_error(rx, "Expected something to apply the +.");
             }
             node_t *node2 = rx_node_create(rx);
+            node_t *node3 = rx_node_create(rx);
+            // The loop goes back to a copy of the atom, so that nothing but
+            // what comes before goes to atom_start, which can then be turned
+            // into something else, like the branch of a |.
+            *node3 = *atom_start;
+            int span = rx_node_consumes(atom_start) && atom_start->next == node;
+            atom_start->type = EMPTY;
+            atom_start->next = node3;
+            atom_start->next2 = node2;
             node->type = BRANCH;
             char c2 = (pos + 1 < regexp_size) ? regexp[pos + 1] : '\0';
             if (c2 == '?') {
                 // non greedy
                 pos += 1;
                 node->next = node2;
-                node->next2 = atom_start;
+                node->next2 = node3;
+                if (span) {
+                    atom_start->type = SPAN_LAZY;
+                }
             } else {
                 // greedy
-                node->next = atom_start;
+                node->next = node3;
                 node->next2 = node2;
+                if (span) {
+                    // The backtracker takes a run of a single character all at
+                    // once with a span, everything else goes on into the loop.
+                    atom_start->type = SPAN;
+                }
             }
             node = node2;
+            if (c2 == '+') {
+                // possessive
+                pos += 1;
+                node = rx_atomic(rx, atom_start, node);
+            }
 
         } else if (c == '?') {
             if (!atom_start) {
@@ -781,6 +1298,11 @@ int rx_init_start (rx_t *rx, int regexp_size, char *regexp, node_t *start, int v
                 atom_start->next = node2;
                 atom_start->next2 = node;
             }
+            if (c2 == '+') {
+                // possessive
+                pos += 1;
+                node = rx_atomic(rx, atom_start, node);
+            }
 
         } else if (c == '{') {
             if (!atom_start) {
@@ -790,6 +1312,14 @@ int rx_init_start (rx_t *rx, int regexp_size, char *regexp, node_t *start, int v
             if (!rx_quantifier_init(rx, pos, &pos, &qval)) {
                 return 0;
             }
+            int copies = qval.max == -1 ? qval.min + 1 : qval.max;
+            if ((long) copies * (rx->nodes_count - atom_start->index) > RX_UNROLL_MAX) {
+                node = rx_counter(rx, atom_start, node, &qval);
+                if (qval.possessive) {
+                    node = rx_atomic(rx, atom_start, node);
+                }
+                continue;
+            }
             node_t *sg_start = atom_start;
             node_t *sg_end = node;
             int i = 0;
@@ -819,6 +1349,7 @@ int rx_init_start (rx_t *rx, int regexp_size, char *regexp, node_t *start, int v
                 node_t *node2 = rx_node_create(rx);
                 node->type = BRANCH;
                 sg_end2->type = BRANCH;
+                node->pos = sg_end2->pos = pos;
                 if (qval.greedy) {
                     node->next = sg_start2;
                     node->next2 = node2;
@@ -831,6 +1362,9 @@ int rx_init_start (rx_t *rx, int regexp_size, char *regexp, node_t *start, int v
                     sg_end2->next2 = sg_start2;
                 }
                 node = node2;
+                if (qval.possessive) {
+                    node = rx_atomic(rx, atom_start, node);
+                }
                 continue;
             }
 
@@ -843,6 +1377,7 @@ int rx_init_start (rx_t *rx, int regexp_size, char *regexp, node_t *start, int v
                     sg_end2 = copy_subgraph(rx, sg_start, sg_end, sg_start2);
                 }
                 node->type = BRANCH;
+                node->pos = pos;
                 if (qval.greedy) {
                     node->next = sg_start2;
                     node->next2 = sg_end2;
@@ -852,6 +1387,9 @@ int rx_init_start (rx_t *rx, int regexp_size, char *regexp, node_t *start, int v
                 }
                 node = sg_end2;
             }
+            if (qval.possessive) {
+                node = rx_atomic(rx, atom_start, node);
+            }
 
         } else if (c == '\\') {
             if (pos + 1 == regexp_size) {
@@ -878,7 +1416,7 @@ int rx_init_start (rx_t *rx, int regexp_size, char *regexp, node_t *start, int v
                 node->next = node2;
                 node = node2;
             } else if (c2 == 'c') {
-                rx->ignorecase = 1;
+                ignorecase_all = 1;
             } else if (c2 == 'e' || c2 == 'r' || c2 == 'n' || c2 == 't') {
                 node_t *node2 = rx_node_create(rx);
                 node->type = TAKE;
@@ -1013,6 +1551,10 @@ int rx_init_start (rx_t *rx, int regexp_size, char *regexp, node_t *start, int v
         node->next = or_end;
         node = or_end;
     }
+    if (ignorecase_all) {
+        rx_fold_node(start);
+        rx_fold_nodes(rx, group_first);
+    }
     node->type = MATCH_END;
     node->value = value;
     if (cap_count > rx->cap_count) {
@@ -1021,102 +1563,48 @@ int rx_init_start (rx_t *rx, int regexp_size, char *regexp, node_t *start, int v
     return 1;
 }
 
-static int flip_case (unsigned char *c) {
-    if (*c >= 'a' && *c <= 'z') {
-        *c -= 'a' - 'A';
+static int rx_match_char_set (int type, unsigned char c) {
+    if (type == CS_ANY) {
         return 1;
-    } else if (*c >= 'A' && *c <= 'Z') {
-        *c += 'a' - 'A';
-        return 1;
-    }
-    else {
-        return 0;
+    } else if (type == CS_NOTNL) {
+        return c != '\n';
+    } else if (type == CS_DIGIT) {
+        return c >= '0' && c <= '9';
+    } else if (type == CS_NOTDIGIT) {
+        return !(c >= '0' && c <= '9');
+    } else if (type == CS_WORD) {
+        return (c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c == '_');
+    } else if (type == CS_NOTWORD) {
+        return !((c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c == '_'));
+    } else if (type == CS_SPACE) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+    } else if (type == CS_NOTSPACE) {
+        return !(c == ' ' || c == '\t' || c == '\n' || c == '\r');
     }
+    return 0;
 }
 
+// Single bytes are looked up in the bitmap, longer characters are looked for in
+// the intervals with a binary search.
 static int rx_match_char_class (rx_t *rx, char_class_t *ccval, int test_size, char *test) {
-    int matched = 0;
-
-    // Check the individual values
-    for (int i = 0; i < ccval->values_count;) {
-        int char1_size = rx_utf8_char_size(ccval->values_count, ccval->values, i);
-        char *char1 = ccval->values + i;
-        if (test_size == char1_size && strncmp(test, char1, test_size) == 0) {
-            matched = 1;
-            goto out;
-        }
-        i += char1_size;
-    }
-
-    // Check the character ranges
-    for (int i = 0; i < ccval->ranges_count;) {
-        int char1_size = rx_utf8_char_size(ccval->ranges_count, ccval->ranges, i);
-        char *char1 = ccval->ranges + i;
-        i += char1_size;
-        int char2_size = rx_utf8_char_size(ccval->ranges_count, ccval->ranges, i);
-        char *char2 = ccval->ranges + i;
-        i += char2_size;
-
-        int ge = (test_size > char1_size) ||
-                 (test_size == char1_size && strncmp(test, char1, test_size) >= 0);
-
-        int le = (test_size < char2_size) ||
-                 (test_size == char2_size && strncmp(test, char2, test_size) <= 0);
-
-        if (ge && le) {
-            matched = 1;
-            goto out;
-        }
+    if (test_size == 1) {
+        unsigned char c = test[0];
+        return (ccval->bytes[c >> 3] >> (c & 7)) & 1;
     }
-
-    // Check the character sets
-    char c = test[0];
-    for (int i = 0; i < ccval->char_sets_count; i += 1) {
-        char cs = ccval->char_sets[i];
-        if (cs == CS_NOTNL) {
-            if (c != '\n') {
-                matched = 1;
-                goto out;
-            }
-        } else if (cs == CS_DIGIT) {
-            if (c >= '0' && c <= '9') {
-                matched = 1;
-                goto out;
-            }
-        } else if (cs == CS_NOTDIGIT) {
-            if (!(c >= '0' && c <= '9')) {
-                matched = 1;
-                goto out;
-            }
-        } else if (cs == CS_WORD) {
-            if ((c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c == '_')) {
-                matched = 1;
-                goto out;
-            }
-        } else if (cs == CS_NOTWORD) {
-            if (!((c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c == '_'))) {
-                matched = 1;
-                goto out;
-            }
-        } else if (cs == CS_SPACE) {
-            if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
-                matched = 1;
-                goto out;
-            }
-        } else if (cs == CS_NOTSPACE) {
-            if (!(c == ' ' || c == '\t' || c == '\n' || c == '\r')) {
-                matched = 1;
-                goto out;
-            }
+    unsigned int n = rx_char_number(test_size, test);
+    int lo = 0;
+    int hi = ccval->intervals_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (n < ccval->intervals[2 * mid]) {
+            hi = mid;
+        } else if (n > ccval->intervals[2 * mid + 1]) {
+            lo = mid + 1;
+        } else {
+            return 1;
         }
     }
-
-    out:
-    if (ccval->negated) {
-        return !matched;
-    } else {
-        return matched;
-    }
+    return 0;
 }
 
 static int rx_match_assertion (int type, int start_pos, int str_size, char *str, int pos) {
@@ -1165,107 +1653,3964 @@ static int rx_match_assertion (int type, int start_pos, int str_size, char *str,
     return 0;
 }
 
-// rx_match() will match a regexp against a given string. The strings it finds
-// will be stored in the matcher argument. The start position can be given, but usually
-// it would be 0 for the start of the string. Returns 1 on success and 0 on failure.
-//
-// The same matcher object can be used multiple times which will reuse the
-// memory allocated for previous matches. All the captures are references into the
-// original string.
-int rx_match (rx_t *rx, matcher_t *m, int str_size, char *str, int start_pos) {
-    m->success = 0;
-    m->path_count = 0;
-    node_t *node = rx->start;
-    int pos = start_pos;
-    unsigned char c;
+// Fills in the matcher's captures once the end of the match has been found. The
+// captures are replayed from the path.
+static int rx_match_end (rx_t *rx, matcher_t *m, node_t *node, char *str, int start_pos, int pos) {
+    // Match cap count is one more than rx cap count since it counts the
+    // entire match as the 0 capture.
+    m->cap_count = rx->cap_count + 1;
+    if (m->cap_count > m->cap_allocated) {
+        m->cap_allocated = m->cap_count;
+        m->cap_start = realloc(m->cap_start, m->cap_allocated * sizeof(int));
+        m->cap_end = realloc(m->cap_end, m->cap_allocated * sizeof(int));
+        m->cap_defined = realloc(m->cap_defined, m->cap_allocated * sizeof(char));
+        m->cap_str = realloc(m->cap_str, m->cap_allocated * sizeof(char *));
+        m->cap_size = realloc(m->cap_size, m->cap_allocated * sizeof(int));
+    }
+    m->cap_defined[0] = 1;
+    m->cap_start[0] = start_pos;
+    m->cap_end[0] = pos;
+    m->cap_str[0] = str + start_pos;
+    m->cap_size[0] = pos - start_pos;
+    for (int i = 1; i < m->cap_count; i++) {
+        m->cap_defined[i] = 0;
+        m->cap_start[i] = 0;
+        m->cap_end[i] = 0;
+        m->cap_str[i] = NULL;
+        m->cap_size[i] = 0;
+    }
+    for (int i = 0; i < m->path_count; i += 1) {
+        path_t *p = m->path + i;
+        if (p->node->type == CAPTURE_START) {
+            int j = p->node->value;
+            m->cap_defined[j] = 1;
+            m->cap_start[j] = p->pos;
+            m->cap_str[j] = str + p->pos;
+        } else if (p->node->type == CAPTURE_END) {
+            int j = p->node->value;
+            m->cap_end[j] = p->pos;
+            m->cap_size[j] = p->pos - m->cap_start[j];
+        }
+    }
+    m->success = 1;
+    m->value = node->value;
+    return 1;
+}
 
-    while (1) {
-        retry:
+static void rx_path_push (matcher_t *m, node_t *node, int pos) {
+    if (m->path_count == m->path_allocated) {
+        m->path_allocated *= 2;
+        m->path = realloc(m->path, m->path_allocated * sizeof(path_t));
+    }
+    path_t *p = m->path + m->path_count;
+    p->pos = pos;
+    p->pos2 = pos;
+    p->node = node;
+    m->path_count += 1;
+}
 
-        switch (node->type) {
-        case TAKE:
-            if (pos >= str_size) {
-                goto try_alternative;
-            }
-            c = str[pos];
-            if (c == node->value) {
-                node = node->next;
-                pos += 1;
-                continue;
-            } else if (rx->ignorecase && flip_case(&c) && c == node->value) {
-                node = node->next;
-                pos += 1;
-                continue;
+// Returns 1 if the node consumes input.
+static int rx_node_consumes (node_t *node) {
+    return node->type == TAKE || node->type == TAKE_NOCASE || node->type == CHAR_CLASS || node->type == CHAR_SET;
+}
+
+// Fills in which bytes a consuming node matches. Returns 1 if the node always
+// consumes exactly one byte. A character class that can match a multibyte utf8
+// character returns 0, bytes then has its single byte matches and all the bytes
+// that could start a multibyte character.
+static int rx_node_bytes (node_t *node, unsigned char *bytes) {
+    int byte_safe = 1;
+    if (node->type == CHAR_CLASS) {
+        // A byte that starts a utf8 character is only matched by itself when
+        // the character isn't proper, so which it is depends on what comes
+        // after it. A class is only sure to take exactly one byte when it
+        // doesn't match any of those either way. The other bytes are always
+        // a character by themselves.
+        char_class_t *ccval = node->ccval;
+        if (ccval->intervals_count) {
+            byte_safe = 0;
+        }
+        for (int c = 0xc0; c < 0x100; c += 1) {
+            if (ccval->bytes[c >> 3] & (1 << (c & 7))) {
+                byte_safe = 0;
             }
-            break;
+        }
+        for (int c = 0; c < 256; c += 1) {
+            bytes[c] = ((ccval->bytes[c >> 3] >> (c & 7)) & 1) || (c >= 0xc0 && !byte_safe);
+        }
+        return byte_safe;
+    }
+    for (int c = 0; c < 256; c += 1) {
+        unsigned char c2 = c;
+        if (node->type == TAKE) {
+            bytes[c] = c2 == (unsigned char) node->value;
+        } else if (node->type == TAKE_NOCASE) {
+            bytes[c] = (c2 | 0x20) == node->value;
+        } else {
+            bytes[c] = rx_match_char_set(node->value, c2);
+        }
+    }
+    return byte_safe;
+}
 
-        case MATCH_END:
-            // End node found!
-            // Match cap count is one more than rx cap count since it counts the
-            // entire match as the 0 capture.
-            m->cap_count = rx->cap_count + 1;
-            if (m->cap_count > m->cap_allocated) {
-                m->cap_allocated = m->cap_count;
-                m->cap_start = realloc(m->cap_start, m->cap_allocated * sizeof(int));
-                m->cap_end = realloc(m->cap_end, m->cap_allocated * sizeof(int));
-                m->cap_defined = realloc(m->cap_defined, m->cap_allocated * sizeof(char));
-                m->cap_str = realloc(m->cap_str, m->cap_allocated * sizeof(char *));
-                m->cap_size = realloc(m->cap_size, m->cap_allocated * sizeof(int));
-            }
-            m->cap_defined[0] = 1;
-            m->cap_start[0] = start_pos;
-            m->cap_end[0] = pos;
-            m->cap_str[0] = str + start_pos;
-            m->cap_size[0] = pos - start_pos;
-            for (int i = 1; i < m->cap_count; i++) {
-                m->cap_defined[i] = 0;
-                m->cap_start[i] = 0;
-                m->cap_end[i] = 0;
-                m->cap_str[i] = NULL;
-                m->cap_size[i] = 0;
-            }
-            for (int i = 0; i < m->path_count; i += 1) {
-                path_t *p = m->path + i;
-                if (p->node->type == CAPTURE_START) {
-                    int j = p->node->value;
-                    m->cap_defined[j] = 1;
-                    m->cap_start[j] = p->pos;
-                    m->cap_str[j] = str + p->pos;
-                } else if (p->node->type == CAPTURE_END) {
-                    int j = p->node->value;
-                    m->cap_end[j] = p->pos;
-                    m->cap_size[j] = p->pos - m->cap_start[j];
-                }
-            }
-            m->success = 1;
-            m->value = node->value;
-            return 1;
-            break;
+static void rx_dfs_push (rx_t *rx, node_t *node) {
+    if (rx->dfs_stack_count >= rx->dfs_stack_allocated) {
+        rx->dfs_stack_allocated *= 2;
+        rx->dfs_stack = realloc(rx->dfs_stack, rx->dfs_stack_allocated * sizeof(node_t *));
+    }
+    rx->dfs_stack[rx->dfs_stack_count] = node;
+    rx->dfs_stack_count += 1;
+}
 
-        case BRANCH:
-        case CAPTURE_START:
-        case CAPTURE_END:
-            {
-                if (m->path_count == m->path_allocated) {
-                    m->path_allocated *= 2;
-                    m->path = realloc(m->path, m->path_allocated * sizeof(path_t));
-                }
-                path_t *p = m->path + m->path_count;
-                p->pos = pos;
-                p->node = node;
-                m->path_count += 1;
-                node = node->next;
-                continue;
-            }
-            break;
+// The Glushkov automaton has a state for each position in the regexp that
+// consumes a byte. A set of states fits in the bits of a 64 bit word, and it's
+// run over the string a byte at a time by looking up the states that follow the
+// current ones, and keeping the ones that match the byte. There's no
+// backtracking, and it doesn't know about captures or which match is the
+// leftmost-first one. Assertions are assumed to always pass, so it accepts a
+// superset of what the regexp matches, which is fine for ruling out strings that
+// can't match.
+//
+// A character class that can match a multibyte character gets a second state
+// for the continuation bytes, which can repeat, so it accepts any number of them.
+struct glushkov_t {
+    int nullable;
+    int chunks;
+    unsigned long long first;
+    unsigned long long final;
+    unsigned long long bytes[256];
+    unsigned long long follow[8][256];
+};
 
-        case GROUP_START:
-        case GROUP_END:
-            node = node->next;
+// Returns the states reached from node without consuming anything. Sets *final
+// if the end of the match is reachable.
+static unsigned long long rx_glushkov_closure (rx_t *rx, node_t *node, int *states, int *visited, int *stamp, int *final) {
+    unsigned long long set = 0;
+    *stamp += 1;
+    rx->dfs_stack_count = 0;
+    rx_dfs_push(rx, node);
+    while (rx->dfs_stack_count) {
+        rx->dfs_stack_count -= 1;
+        node = rx->dfs_stack[rx->dfs_stack_count];
+        if (visited[node->index] == *stamp) {
             continue;
-            break;
+        }
+        visited[node->index] = *stamp;
+        if (rx_node_consumes(node)) {
+            set |= 1ULL << states[node->index];
+        } else if (node->type == MATCH_END) {
+            *final = 1;
+        } else if (node->type == BRANCH) {
+            rx_dfs_push(rx, node->next2);
+            rx_dfs_push(rx, node->next);
+        } else {
+            rx_dfs_push(rx, node->next);
+        }
+    }
+    return set;
+}
+
+static void rx_glushkov_init (rx_t *rx) {
+    int *states = malloc(rx->nodes_count * sizeof(int));
+    int *visited = calloc(rx->nodes_count, sizeof(int));
+    int stamp = 0;
+    unsigned char bytes[256];
+    int states_count = 0;
+    unsigned long long follow[64];
+    glushkov_t *g = NULL;
+
+    // Number the states of the reachable nodes, and check the regexp doesn't
+    // have anything the automaton can't handle.
+    rx->dfs_stack_count = 0;
+    rx_dfs_push(rx, rx->start);
+    stamp += 1;
+    while (rx->dfs_stack_count) {
+        rx->dfs_stack_count -= 1;
+        node_t *node = rx->dfs_stack[rx->dfs_stack_count];
+        if (visited[node->index] == stamp) {
+            continue;
+        }
+        visited[node->index] = stamp;
+        if (node->type == ASSERTION && (node->value == ASSERT_SOS || node->value == ASSERT_SOP)) {
+            // These stop rx_match() from trying other start positions, which
+            // the automaton doesn't do.
+            goto out;
+        }
+        if (rx_node_consumes(node)) {
+            states[node->index] = states_count;
+            states_count += 1;
+            if (node->type == CHAR_CLASS && !rx_node_bytes(node, bytes)) {
+                states_count += 1;
+            }
+            if (states_count > 64) {
+                goto out;
+            }
+        }
+        if (node->type == BRANCH) {
+            rx_dfs_push(rx, node->next2);
+        }
+        if (node->type != MATCH_END) {
+            rx_dfs_push(rx, node->next);
+        }
+    }
+
+    g = calloc(1, sizeof(glushkov_t));
+    g->chunks = (states_count + 7) / 8;
+    g->first = rx_glushkov_closure(rx, rx->start, states, visited, &stamp, &g->nullable);
+    for (int i = 0; i < rx->nodes_count; i += 1) {
+        node_t *node = rx->nodes[i];
+        if (visited[i] == 0 || !rx_node_consumes(node)) {
+            continue;
+        }
+        int state = states[i];
+        int final = 0;
+        follow[state] = rx_glushkov_closure(rx, node->next, states, visited, &stamp, &final);
+        if (final) {
+            g->final |= 1ULL << state;
+        }
+        if (!rx_node_bytes(node, bytes)) {
+            // The continuation bytes of a multibyte character
+            follow[state] |= 1ULL << (state + 1);
+            follow[state + 1] = follow[state];
+            for (int c = 0x80; c < 0xc0; c += 1) {
+                g->bytes[c] |= 1ULL << (state + 1);
+            }
+            if (final) {
+                g->final |= 1ULL << (state + 1);
+            }
+        }
+        for (int c = 0; c < 256; c += 1) {
+            if (bytes[c]) {
+                g->bytes[c] |= 1ULL << state;
+            }
+        }
+    }
+
+    // Precompute the union of the follow sets for each byte of the state set.
+    for (int k = 0; k < g->chunks; k += 1) {
+        for (int b = 0; b < 256; b += 1) {
+            unsigned long long set = 0;
+            for (int j = 0; j < 8; j += 1) {
+                if (b & (1 << j) && 8 * k + j < states_count) {
+                    set |= follow[8 * k + j];
+                }
+            }
+            g->follow[k][b] = set;
+        }
+    }
+
+    out:
+    rx->internal->glushkov = g;
+    free(states);
+    free(visited);
+}
+
+// Runs the Glushkov automaton from pos. Returns 0 if it reached the end of the
+// string without accepting, which means there's no match. Otherwise *start is set
+// to where the automaton last had no states, no match can start before then.
+static int rx_glushkov_scan (glushkov_t *g, int str_size, char *str, int pos, int *start) {
+    unsigned long long set = 0;
+    *start = pos;
+    if (g->nullable) {
+        return 1;
+    }
+    for (; pos < str_size; pos += 1) {
+        unsigned long long next = g->first;
+        for (int k = 0; k < g->chunks; k += 1) {
+            next |= g->follow[k][(set >> (8 * k)) & 0xff];
+        }
+        set = next & g->bytes[(unsigned char) str[pos]];
+        if (!set) {
+            *start = pos + 1;
+        } else if (set & g->final) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// A regexp is one-pass when, from any point in it, the next byte decides which
+// way to go, so it never has to come back and try another way. For those, the
+// one-pass engine follows a table from state to state a byte at a time, writing
+// the captures to the path as it goes. There's a state for the start and one
+// after each consuming node. Each state has a list of leaves in the order the
+// backtracker would try them, which are the consuming nodes and match ends that
+// can be reached from it without consuming anything, along with the captures and
+// assertions on the way.
+//
+// A match end that comes before the leaf for the next byte ends the match. One
+// that comes after it is remembered, and is used if the match gets stuck later,
+// which is what the backtracker would end up finding.
+typedef struct {
+    node_t *node;
+    int state;
+    int asserts;
+    int ops_start;
+    int ops_count;
+} onepass_leaf_t;
+
+struct onepass_t {
+    int anchored;
+    int asserts_first;
+    int states_count;
+    int leaves_count;
+    int leaves_allocated;
+    onepass_leaf_t *leaves;
+    int ops_count;
+    int ops_allocated;
+    node_t **ops;
+    int *leaves_start;
+    int *ends_start;
+    int *table;
+    int *fast;
+};
+
+typedef struct {
+    node_t *node;
+    int ops_count;
+    int asserts;
+    int anchored;
+} onepass_item_t;
+
+// The number of states a one-pass table is allowed to have
+#define ONEPASS_MAX_STATES 1000
+
+static void rx_onepass_free (onepass_t *op) {
+    if (!op) {
+        return;
+    }
+    free(op->leaves);
+    free(op->ops);
+    free(op->leaves_start);
+    free(op->ends_start);
+    free(op->table);
+    free(op->fast);
+    free(op);
+}
+
+static void rx_onepass_init (rx_t *rx) {
+    onepass_t *op = calloc(1, sizeof(onepass_t));
+    node_t **consumers = malloc((rx->nodes_count + 1) * sizeof(node_t *));
+    int *states = malloc(rx->nodes_count * sizeof(int));
+    int *visited = calloc(rx->nodes_count, sizeof(int));
+    char *visited_asserts = malloc(rx->nodes_count);
+    int items_allocated = 16;
+    onepass_item_t *items = malloc(items_allocated * sizeof(onepass_item_t));
+    int scratch_allocated = 16;
+    node_t **scratch = malloc(scratch_allocated * sizeof(node_t *));
+    unsigned char bytes[256];
+    int ok = 0;
+
+    // State 0 is the start, the rest are after the consuming nodes.
+    op->states_count = 1;
+    for (int i = 0; i < rx->nodes_count; i += 1) {
+        if (rx->nodes[i]->type == ATOMIC_START) {
+            // The table goes every way it can, an atomic group doesn't.
+            goto out;
+        }
+        if (rx->nodes[i]->type == COUNT_START) {
+            // Where a counted loop goes depends on the counter, not just the byte.
+            goto out;
+        }
+        if (rx_node_consumes(rx->nodes[i])) {
+            if (!rx_node_bytes(rx->nodes[i], bytes)) {
+                goto out;
+            }
+            states[i] = op->states_count;
+            consumers[op->states_count] = rx->nodes[i];
+            op->states_count += 1;
+        }
+    }
+    if (op->states_count > ONEPASS_MAX_STATES) {
+        goto out;
+    }
+    op->leaves_start = malloc((op->states_count + 1) * sizeof(int));
+    op->ends_start = malloc(op->states_count * sizeof(int));
+    op->table = calloc(op->states_count * 256, sizeof(int));
+    op->anchored = 1;
+
+    for (int state = 0; state < op->states_count; state += 1) {
+        op->leaves_start[state] = op->leaves_count;
+        op->ends_start[state] = -1;
+        int items_count = 1;
+        items[0].node = state ? consumers[state]->next : rx->start;
+        items[0].ops_count = 0;
+        items[0].asserts = 0;
+        items[0].anchored = 0;
+        int stamp = state + 1;
+        while (items_count) {
+            items_count -= 1;
+            onepass_item_t item = items[items_count];
+            node_t *node = item.node;
+            if (visited[node->index] == stamp) {
+                // A second way to the same node goes the same way from there, so
+                // it's only needed when the first way had an assertion that
+                // might not pass.
+                if (visited_asserts[node->index]) {
+                    goto out;
+                }
+                continue;
+            }
+            visited[node->index] = stamp;
+            visited_asserts[node->index] = item.asserts;
+
+            if (rx_node_consumes(node) || node->type == MATCH_END) {
+                if (state == 0 && !item.anchored) {
+                    op->anchored = 0;
+                }
+                if (op->leaves_count == op->leaves_allocated) {
+                    op->leaves_allocated = op->leaves_allocated ? 2 * op->leaves_allocated : 16;
+                    op->leaves = realloc(op->leaves, op->leaves_allocated * sizeof(onepass_leaf_t));
+                }
+                if (op->ops_count + item.ops_count > op->ops_allocated) {
+                    op->ops_allocated = 2 * (op->ops_count + item.ops_count) + 16;
+                    op->ops = realloc(op->ops, op->ops_allocated * sizeof(node_t *));
+                }
+                onepass_leaf_t *leaf = op->leaves + op->leaves_count;
+                leaf->node = node;
+                leaf->state = node->type == MATCH_END ? -1 : states[node->index];
+                leaf->asserts = item.asserts;
+                leaf->ops_start = op->ops_count;
+                if (node->type == MATCH_END && op->ends_start[state] < 0) {
+                    op->ends_start[state] = op->leaves_count;
+                }
+                leaf->ops_count = item.ops_count;
+                if (item.ops_count) {
+                    memcpy(op->ops + op->ops_count, scratch, item.ops_count * sizeof(node_t *));
+                }
+                op->ops_count += item.ops_count;
+                op->leaves_count += 1;
+
+                if (node->type != MATCH_END) {
+                    // Two leaves that take the same byte means it's not one-pass.
+                    rx_node_bytes(node, bytes);
+                    int *table = op->table + 256 * state;
+                    for (int c = 0; c < 256; c += 1) {
+                        if (bytes[c]) {
+                            if (table[c]) {
+                                goto out;
+                            }
+                            table[c] = op->leaves_count;
+                        }
+                    }
+                }
+                continue;
+            }
+
+            if (node->type == CAPTURE_START || node->type == CAPTURE_END || node->type == ASSERTION) {
+                if (node->type == ASSERTION) {
+                    if ((node->value == ASSERT_SOS || node->value == ASSERT_SOP) && state != 0) {
+                        // These fail the whole rx_match() when they don't pass,
+                        // instead of trying another way.
+                        goto out;
+                    }
+                    item.asserts = 1;
+                    if (node->value == ASSERT_SOS) {
+                        item.anchored = 1;
+                    } else if (state == 0 && !item.anchored) {
+                        op->asserts_first = 1;
+                    }
+                }
+                if (item.ops_count == scratch_allocated) {
+                    scratch_allocated *= 2;
+                    scratch = realloc(scratch, scratch_allocated * sizeof(node_t *));
+                }
+                scratch[item.ops_count] = node;
+                item.ops_count += 1;
+            }
+
+            if (items_count + 2 > items_allocated) {
+                items_allocated *= 2;
+                items = realloc(items, items_allocated * sizeof(onepass_item_t));
+            }
+            if (node->type == BRANCH) {
+                items[items_count] = item;
+                items[items_count].node = node->next2;
+                items_count += 1;
+            }
+            items[items_count] = item;
+            items[items_count].node = node->next;
+            items_count += 1;
+        }
+    }
+    op->leaves_start[op->states_count] = op->leaves_count;
+
+    // The fast table has the next state + 1 for the bytes that don't need
+    // anything else done, from states that can't end the match.
+    op->fast = calloc(op->states_count * 256, sizeof(int));
+    for (int i = 0; i < op->states_count * 256; i += 1) {
+        onepass_leaf_t *leaf = op->table[i] ? op->leaves + op->table[i] - 1 : NULL;
+        if (leaf && !leaf->ops_count && op->ends_start[i / 256] < 0) {
+            op->fast[i] = leaf->state + 1;
+        }
+    }
+    ok = 1;
+
+    out:
+    if (ok) {
+        rx->internal->onepass = op;
+    } else {
+        rx_onepass_free(op);
+    }
+    free(consumers);
+    free(states);
+    free(visited);
+    free(visited_asserts);
+    free(items);
+    free(scratch);
+}
+
+// Checks the assertions on the way to a leaf.
+static int rx_onepass_check (onepass_t *op, onepass_leaf_t *leaf, int start_pos, int str_size, char *str, int pos) {
+    if (!leaf->asserts) {
+        return 1;
+    }
+    for (int i = 0; i < leaf->ops_count; i += 1) {
+        node_t *node = op->ops[leaf->ops_start + i];
+        if (node->type == ASSERTION && !rx_match_assertion(node->value, start_pos, str_size, str, pos)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void rx_onepass_captures (onepass_t *op, onepass_leaf_t *leaf, matcher_t *m, int pos) {
+    for (int i = 0; i < leaf->ops_count; i += 1) {
+        node_t *node = op->ops[leaf->ops_start + i];
+        if (node->type != ASSERTION) {
+            rx_path_push(m, node, pos);
+        }
+    }
+}
+
+// How many steps the backtracker takes between looking at the clock and at
+// m->cancel
+#define RX_CHECK_STEPS 1024
+
+// How many bytes the engines that go through the string a byte at a time take
+// between looking at the clock and at m->cancel
+#define RX_CHECK_BYTES 65536
+
+// Returns the time in microseconds from some point that doesn't move.
+static long long rx_usec (void) {
+#ifdef _WIN32
+    LARGE_INTEGER count, freq;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+    return count.QuadPart / freq.QuadPart * 1000000 + count.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+// Returns RESULT_CANCELED or RESULT_TIME_LIMIT if the match has to stop for
+// m->cancel or m->time_limit, or 0. m->cancel is set by another thread, so it's
+// read atomically where that can be asked for.
+static int rx_limits_time (matcher_t *m, long long start_time) {
+#if defined(__GNUC__) || defined(__clang__)
+    int cancel = __atomic_load_n(&m->cancel, __ATOMIC_RELAXED);
+#else
+    int cancel = m->cancel;
+#endif
+    if (cancel) {
+        return RESULT_CANCELED;
+    }
+    if (m->time_limit > 0 && rx_usec() - start_time >= m->time_limit) {
+        return RESULT_TIME_LIMIT;
+    }
+    return 0;
+}
+
+// Returns why the backtracker has to stop after the steps it's taken, or 0 if
+// it doesn't, in which case it sets the steps it can go on to before it's
+// called again. quantum_end is the step it yields at, or 0.
+static int rx_limits (matcher_t *m, long steps, long long start_time, long quantum_end, long *next_check) {
+    m->steps = steps;
+    if (m->step_limit > 0 && steps >= m->step_limit) {
+        return RESULT_STEP_LIMIT;
+    }
+    int result = rx_limits_time(m, start_time);
+    if (result) {
+        return result;
+    }
+    if (quantum_end && steps >= quantum_end) {
+        // The step it's at hasn't been taken yet, resuming takes it.
+        m->steps = steps - 1;
+        return RESULT_IN_PROGRESS;
+    }
+    *next_check = steps + RX_CHECK_STEPS;
+    if (m->step_limit > 0 && *next_check > m->step_limit) {
+        *next_check = m->step_limit;
+    }
+    if (quantum_end && *next_check > quantum_end) {
+        *next_check = quantum_end;
+    }
+    return 0;
+}
+
+// Tries to match starting at start_pos only. If it stops for m->cancel or
+// m->time_limit, it sets m->result and fails.
+static int rx_onepass_match (rx_t *rx, matcher_t *m, int str_size, char *str, int start_pos, long long start_time) {
+    onepass_t *op = rx->internal->onepass;
+    int state = 0;
+    int pos = start_pos;
+    onepass_leaf_t *saved = NULL;
+    int saved_pos = 0;
+    int saved_path_count = 0;
+    int next_check = pos + RX_CHECK_BYTES;
+    while (1) {
+        if (pos >= next_check) {
+            m->result = rx_limits_time(m, start_time);
+            if (m->result) {
+                return 0;
+            }
+            next_check = pos + RX_CHECK_BYTES;
+        }
+        int stop = str_size < next_check ? str_size : next_check;
+        while (pos < stop) {
+            int next_state = op->fast[256 * state + (unsigned char) str[pos]];
+            if (!next_state) {
+                break;
+            }
+            state = next_state - 1;
+            pos += 1;
+        }
+        if (pos == next_check && pos < str_size) {
+            continue;
+        }
+        onepass_leaf_t *next = NULL;
+        if (pos >= str_size) {
+            m->hit_end = 1;
+        } else {
+            int i = op->table[256 * state + (unsigned char) str[pos]];
+            if (i) {
+                next = op->leaves + i - 1;
+                if (!rx_onepass_check(op, next, start_pos, str_size, str, pos)) {
+                    next = NULL;
+                }
+            }
+        }
+
+        // Look for a match end that passes its assertions, stopping at the
+        // leaf that takes the next byte.
+        onepass_leaf_t *end = NULL;
+        int i = op->ends_start[state];
+        for (; i >= 0 && i < op->leaves_start[state + 1]; i += 1) {
+            onepass_leaf_t *leaf = op->leaves + i;
+            if (leaf->state < 0 && rx_onepass_check(op, leaf, start_pos, str_size, str, pos)) {
+                end = leaf;
+                break;
+            }
+        }
+        if (end && (!next || end < next)) {
+            rx_onepass_captures(op, end, m, pos);
+            return rx_match_end(rx, m, end->node, str, start_pos, pos);
+        }
+        if (!next) {
+            break;
+        }
+        if (end) {
+            saved = end;
+            saved_pos = pos;
+            saved_path_count = m->path_count;
+        }
+        if (next->ops_count) {
+            rx_onepass_captures(op, next, m, pos);
+        }
+        pos += 1;
+        state = next->state;
+    }
+    if (saved) {
+        m->path_count = saved_path_count;
+        rx_onepass_captures(op, saved, m, saved_pos);
+        return rx_match_end(rx, m, saved->node, str, start_pos, saved_pos);
+    }
+    return 0;
+}
+
+// A tagged DFA matches in one pass over the string and still gets the captures
+// the backtracker would find. Its states are what a backtracker would have going
+// at once if it tried every way in parallel: an ordered list of threads, highest
+// priority first, each waiting at a node after a consuming one. Two threads at the
+// same node go the same way from there on, so only the first one is kept, which is
+// the one the backtracker would have tried first. Each thread has registers for
+// the positions of its captures (the tags), and each transition says which thread
+// each new thread came from and which tags are set to the current position.
+//
+// Assertions are checked when leaving a state, which is when both the byte before
+// and the byte after the position are known, so the state also remembers what
+// kind of byte came before it. A new thread that starts the match is added at the
+// lowest priority at each position until a match is found.
+//
+// Captures are kept in registers instead of the path, so they're only taken from
+// it when each capture group is entered at most once, then the path can be made
+// from them. Otherwise it's still used to find where the match is.
+typedef struct {
+    int src;
+    int ops_start;
+    int ops_count;
+} tdfa_thread_t;
+
+typedef struct {
+    int target;
+    int in_place;
+    int identity;
+    int threads_start;
+    int threads_count;
+    node_t *match;
+    int match_src;
+    int match_ops_start;
+    int match_ops_count;
+} tdfa_trans_t;
+
+typedef struct {
+    int *key;
+    int threads_count;
+} tdfa_state_t;
+
+struct tdfa_t {
+    int anchored;
+    int captures;
+    int tags_count;
+    int max_threads;
+    int classes_count;
+    int classes[256];
+    int initial[4];
+    int states_count;
+    int states_allocated;
+    int max_states;
+    tdfa_state_t *states;
+    tdfa_trans_t *trans;
+    tdfa_trans_t *ends;
+    int *span_fast;
+    int *tags_fast;
+    int threads_count;
+    int threads_allocated;
+    tdfa_thread_t *threads;
+    int ops_count;
+    int ops_allocated;
+    int *ops;
+    node_t **tag_nodes;
+    int *tag_ranks;
+};
+
+typedef struct {
+    node_t *node;
+    int ops_count;
+} tdfa_item_t;
+
+// What rx_tdfa_init() needs while it's making the states.
+typedef struct {
+    int *visited;
+    int stamp;
+    unsigned char *accepts;
+    int items_allocated;
+    tdfa_item_t *items;
+    int scratch_allocated;
+    int *scratch;
+} tdfa_build_t;
+
+// The kinds of byte that can come before a position, which is all the
+// assertions need to know about it.
+enum {
+    TDFA_PREV_SOS,
+    TDFA_PREV_NL,
+    TDFA_PREV_WORD,
+    TDFA_PREV_OTHER,
+};
+
+// The number of states a tagged DFA is allowed to have, or for a regexp that
+// rx_analyze() found the backtracker could be slow for, times this
+#define TDFA_MAX_STATES 1000
+#define TDFA_SLOW_FACTOR 8
+
+static void rx_tdfa_free (tdfa_t *t) {
+    if (!t) {
+        return;
+    }
+    for (int i = 0; i < t->states_count; i += 1) {
+        free(t->states[i].key);
+    }
+    free(t->states);
+    free(t->trans);
+    free(t->ends);
+    free(t->span_fast);
+    free(t->tags_fast);
+    free(t->threads);
+    free(t->ops);
+    free(t->tag_nodes);
+    free(t->tag_ranks);
+    free(t);
+}
+
+static int rx_tdfa_prev (char c) {
+    if (c == '\n') {
+        return TDFA_PREV_NL;
+    } else if ((c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c == '_')) {
+        return TDFA_PREV_WORD;
+    }
+    return TDFA_PREV_OTHER;
+}
+
+// A state's key is whether it adds threads that start the match, the kind of the
+// byte before it, the number of threads, and the nodes they're at.
+static unsigned int rx_tdfa_key_hash (void *key) {
+    int *k = key;
+    unsigned int hash = 5381;
+    for (int i = 0; i < k[2] + 3; i += 1) {
+        hash = (hash << 5) + hash + k[i];
+    }
+    return hash;
+}
+
+static int rx_tdfa_key_equal (void *key1, void *key2) {
+    int *k1 = key1;
+    int *k2 = key2;
+    return k1[2] == k2[2] && memcmp(k1, k2, (k1[2] + 3) * sizeof(int)) == 0;
+}
+
+static int rx_tdfa_add_ops (tdfa_t *t, int *ops, int ops_count) {
+    if (t->ops_count + ops_count > t->ops_allocated) {
+        t->ops_allocated = 2 * (t->ops_count + ops_count) + 16;
+        t->ops = realloc(t->ops, t->ops_allocated * sizeof(int));
+    }
+    memcpy(t->ops + t->ops_count, ops, ops_count * sizeof(int));
+    t->ops_count += ops_count;
+    return t->ops_count - ops_count;
+}
+
+// Checks the capture groups are each entered at most once, and ranks the capture
+// nodes so the ones that come first in a match rank lower.
+static int rx_tdfa_tags (rx_t *rx, tdfa_t *t, int *visited) {
+    int stamp = 0;
+    t->tag_nodes = calloc(t->tags_count, sizeof(node_t *));
+    t->tag_ranks = calloc(t->tags_count, sizeof(int));
+    for (int i = 0; i < rx->nodes_count; i += 1) {
+        node_t *node = rx->nodes[i];
+        if (node->type != CAPTURE_START && node->type != CAPTURE_END) {
+            continue;
+        }
+        int tag = 2 * (node->value - 1) + (node->type == CAPTURE_END);
+        if (t->tag_nodes[tag]) {
+            return 0;
+        }
+        t->tag_nodes[tag] = node;
+
+        // Count the capture nodes reachable from this one. A node that can reach
+        // itself is in a loop.
+        stamp += 1;
+        rx->dfs_stack_count = 0;
+        rx_dfs_push(rx, node->next);
+        while (rx->dfs_stack_count) {
+            rx->dfs_stack_count -= 1;
+            node_t *node2 = rx->dfs_stack[rx->dfs_stack_count];
+            if (visited[node2->index] == stamp) {
+                continue;
+            }
+            visited[node2->index] = stamp;
+            if (node2 == node) {
+                return 0;
+            }
+            if (node2->type == CAPTURE_START || node2->type == CAPTURE_END) {
+                t->tag_ranks[tag] -= 1;
+            }
+            if (node2->type == BRANCH) {
+                rx_dfs_push(rx, node2->next2);
+            }
+            if (node2->type != MATCH_END) {
+                rx_dfs_push(rx, node2->next);
+            }
+        }
+    }
+    return 1;
+}
+
+// Finds the state for a key, adding it if it's new. Returns -1 for the state
+// with nothing left to do, and -2 when there are too many states.
+static int rx_tdfa_state (tdfa_t *t, hash_t *map, int *key) {
+    if (!key[0] && !key[2]) {
+        return -1;
+    }
+    void *value = hash_lookup(map, key);
+    if (value) {
+        return (int) (long) value - 1;
+    }
+    if (t->states_count == t->max_states) {
+        return -2;
+    }
+    if (t->states_count == t->states_allocated) {
+        t->states_allocated = t->states_allocated ? 2 * t->states_allocated : 16;
+        t->states = realloc(t->states, t->states_allocated * sizeof(tdfa_state_t));
+    }
+    tdfa_state_t *state = t->states + t->states_count;
+    state->key = malloc((key[2] + 3) * sizeof(int));
+    memcpy(state->key, key, (key[2] + 3) * sizeof(int));
+    state->threads_count = key[2];
+    if (state->threads_count > t->max_threads) {
+        t->max_threads = state->threads_count;
+    }
+    t->states_count += 1;
+    hash_insert(map, state->key, (void *) (long) t->states_count);
+    return t->states_count - 1;
+}
+
+// Runs the threads of a state through the nodes that don't consume anything,
+// given the kind of byte before and the byte after (-1 at the end of the
+// string), and fills in the transition and the key of the state it goes to.
+static void rx_tdfa_step (rx_t *rx, tdfa_t *t, tdfa_build_t *b, int *key, int c, tdfa_trans_t *tr, int *next_key) {
+    char context[2];
+    int prev = key[1];
+    context[0] = prev == TDFA_PREV_NL ? '\n' : prev == TDFA_PREV_WORD ? 'a' : ' ';
+    context[1] = c;
+    int context_pos = prev == TDFA_PREV_SOS ? 0 : 1;
+    int context_size = context_pos + (c >= 0);
+    char *context_str = context + 1 - context_pos;
+
+    // The second half of visited marks the nodes the new threads wait at, so a
+    // lower priority thread that ends up at one of them too is dropped.
+    int *waiting = b->visited + rx->nodes_count;
+    b->stamp += 1;
+    tr->threads_start = t->threads_count;
+    tr->threads_count = 0;
+    tr->match = NULL;
+    tr->in_place = 1;
+    tr->identity = 1;
+    next_key[2] = 0;
+    for (int i = 0; i <= key[2] && !tr->match; i += 1) {
+        int items_count = 1;
+        if (i < key[2]) {
+            b->items[0].node = rx->nodes[key[i + 3]];
+            b->items[0].ops_count = 0;
+        } else if (key[0]) {
+            // The thread that starts the match here
+            b->items[0].node = rx->start;
+            b->items[0].ops_count = 1;
+            b->scratch[0] = t->tags_count - 1;
+        } else {
+            break;
+        }
+        int src = i < key[2] ? i : -1;
+        while (items_count) {
+            items_count -= 1;
+            tdfa_item_t item = b->items[items_count];
+            node_t *node = item.node;
+            if (b->visited[node->index] == b->stamp) {
+                continue;
+            }
+            b->visited[node->index] = b->stamp;
+
+            if (rx_node_consumes(node)) {
+                if (c < 0 || !b->accepts[node->index * 256 + c] || waiting[node->next->index] == b->stamp) {
+                    continue;
+                }
+                waiting[node->next->index] = b->stamp;
+                if (t->threads_count == t->threads_allocated) {
+                    t->threads_allocated = t->threads_allocated ? 2 * t->threads_allocated : 16;
+                    t->threads = realloc(t->threads, t->threads_allocated * sizeof(tdfa_thread_t));
+                }
+                tdfa_thread_t *thread = t->threads + t->threads_count;
+                thread->src = src;
+                thread->ops_count = item.ops_count;
+                thread->ops_start = rx_tdfa_add_ops(t, b->scratch, item.ops_count);
+                if (src >= 0 && src < tr->threads_count) {
+                    tr->in_place = 0;
+                }
+                if (src != tr->threads_count || item.ops_count) {
+                    tr->identity = 0;
+                }
+                next_key[next_key[2] + 3] = node->next->index;
+                next_key[2] += 1;
+                t->threads_count += 1;
+                tr->threads_count += 1;
+                continue;
+            }
+            if (node->type == MATCH_END) {
+                // Everything after this has a lower priority than the match.
+                tr->match = node;
+                tr->match_src = src;
+                tr->match_ops_count = item.ops_count;
+                tr->match_ops_start = rx_tdfa_add_ops(t, b->scratch, item.ops_count);
+                break;
+            }
+            if (node->type == ASSERTION && !rx_match_assertion(node->value, 0, context_size, context_str, context_pos)) {
+                continue;
+            }
+            if (node->type == CAPTURE_START || node->type == CAPTURE_END) {
+                if (item.ops_count == b->scratch_allocated) {
+                    b->scratch_allocated *= 2;
+                    b->scratch = realloc(b->scratch, b->scratch_allocated * sizeof(int));
+                }
+                b->scratch[item.ops_count] = 2 * (node->value - 1) + (node->type == CAPTURE_END);
+                item.ops_count += 1;
+            }
+            if (items_count + 2 > b->items_allocated) {
+                b->items_allocated *= 2;
+                b->items = realloc(b->items, b->items_allocated * sizeof(tdfa_item_t));
+            }
+            if (node->type == BRANCH) {
+                b->items[items_count] = item;
+                b->items[items_count].node = node->next2;
+                items_count += 1;
+            }
+            b->items[items_count] = item;
+            b->items[items_count].node = node->next;
+            items_count += 1;
+        }
+    }
+    next_key[0] = key[0] && !tr->match && !t->anchored;
+    next_key[1] = c >= 0 ? rx_tdfa_prev(c) : 0;
+}
+
+static void rx_tdfa_init (rx_t *rx) {
+    tdfa_t *t = calloc(1, sizeof(tdfa_t));
+    t->max_states = rx->complexity > COMPLEXITY_LINEAR ? TDFA_SLOW_FACTOR * TDFA_MAX_STATES : TDFA_MAX_STATES;
+    tdfa_build_t b;
+    b.visited = calloc(2 * rx->nodes_count, sizeof(int));
+    b.stamp = 0;
+    b.accepts = calloc(rx->nodes_count, 256);
+    b.items_allocated = 16;
+    b.items = malloc(b.items_allocated * sizeof(tdfa_item_t));
+    b.scratch_allocated = 16;
+    b.scratch = malloc(b.scratch_allocated * sizeof(int));
+    int trans_allocated = 0;
+    int *key = malloc((rx->nodes_count + 3) * sizeof(int));
+    int *next_key = malloc((rx->nodes_count + 3) * sizeof(int));
+    hash_t *map = hash_init(rx_tdfa_key_hash, rx_tdfa_key_equal);
+    int reps[256];
+    int ok = 0;
+
+    // Check the regexp doesn't have anything the DFA can't handle.
+    for (int i = 0; i < rx->nodes_count; i += 1) {
+        node_t *node = rx->nodes[i];
+        if (rx_node_consumes(node) && !rx_node_bytes(node, b.accepts + 256 * i)) {
+            goto out;
+        }
+        if (node->type == ASSERTION && (node->value == ASSERT_SOP || (node->value == ASSERT_SOS && node != rx->start))) {
+            // These stop rx_match() from trying anything else when they fail,
+            // which is only the same as not matching when they come first.
+            goto out;
+        }
+        if (node->type == ATOMIC_START) {
+            // The DFA runs every way at once, including the ones an atomic
+            // group would have given up on.
+            goto out;
+        }
+        if (node->type == COUNT_START) {
+            // The states would need a copy of the loop for each count.
+            goto out;
+        }
+    }
+    t->anchored = rx->start->type == ASSERTION && rx->start->value == ASSERT_SOS;
+    t->tags_count = 2 * rx->cap_count + 1;
+    t->captures = rx_tdfa_tags(rx, t, b.visited);
+    memset(b.visited, 0, 2 * rx->nodes_count * sizeof(int));
+
+    // Bytes that every node and assertion treats the same share a class.
+    for (int c = 0; c < 256; c += 1) {
+        int k;
+        for (k = 0; k < t->classes_count; k += 1) {
+            int c2 = reps[k];
+            if (rx_tdfa_prev(c) != rx_tdfa_prev(c2) || (c == '\r') != (c2 == '\r')) {
+                continue;
+            }
+            int i;
+            for (i = 0; i < rx->nodes_count; i += 1) {
+                if (b.accepts[256 * i + c] != b.accepts[256 * i + c2]) {
+                    break;
+                }
+            }
+            if (i == rx->nodes_count) {
+                break;
+            }
+        }
+        if (k == t->classes_count) {
+            reps[k] = c;
+            t->classes_count += 1;
+        }
+        t->classes[c] = k;
+    }
+
+    for (int prev = 0; prev < 4; prev += 1) {
+        key[0] = 1;
+        key[1] = prev;
+        key[2] = 0;
+        t->initial[prev] = rx_tdfa_state(t, map, key);
+    }
+    for (int s = 0; s < t->states_count; s += 1) {
+        if (trans_allocated < t->states_allocated) {
+            trans_allocated = t->states_allocated;
+            t->trans = realloc(t->trans, trans_allocated * t->classes_count * sizeof(tdfa_trans_t));
+            t->ends = realloc(t->ends, trans_allocated * sizeof(tdfa_trans_t));
+        }
+        memcpy(key, t->states[s].key, (t->states[s].threads_count + 3) * sizeof(int));
+        for (int k = 0; k <= t->classes_count; k += 1) {
+            tdfa_trans_t *tr = k < t->classes_count ? t->trans + s * t->classes_count + k : t->ends + s;
+            rx_tdfa_step(rx, t, &b, key, k < t->classes_count ? reps[k] : -1, tr, next_key);
+            tr->target = k < t->classes_count ? rx_tdfa_state(t, map, next_key) : -1;
+            if (tr->target == -2) {
+                goto out;
+            }
+        }
+    }
+
+    // The fast tables have the offset of the next state's transitions for the
+    // bytes where nothing else needs doing, or -1.
+    t->span_fast = malloc(t->states_count * t->classes_count * sizeof(int));
+    t->tags_fast = malloc(t->states_count * t->classes_count * sizeof(int));
+    for (int i = 0; i < t->states_count * t->classes_count; i += 1) {
+        tdfa_trans_t *tr = t->trans + i;
+        int plain = !tr->match && tr->target >= 0;
+        t->span_fast[i] = plain && tr->threads_count ? tr->target * t->classes_count : -1;
+        t->tags_fast[i] = plain && tr->identity ? tr->target * t->classes_count : -1;
+    }
+    ok = 1;
+
+    out:
+    if (ok) {
+        rx->internal->tdfa = t;
+    } else {
+        rx_tdfa_free(t);
+    }
+    free(b.visited);
+    free(b.accepts);
+    free(b.items);
+    free(b.scratch);
+    free(key);
+    free(next_key);
+    hash_free(map);
+}
+
+// Copies the registers of a thread and sets its tags to pos.
+static void rx_tdfa_apply (tdfa_t *t, int *dest, int *src, int *ops, int ops_count, int pos) {
+    if (src) {
+        memmove(dest, src, t->tags_count * sizeof(int));
+    } else {
+        for (int i = 0; i < t->tags_count; i += 1) {
+            dest[i] = -1;
+        }
+    }
+    for (int i = 0; i < ops_count; i += 1) {
+        dest[ops[i]] = pos;
+    }
+}
+
+// Makes the path from the registers of the match, in the order the backtracker
+// would have visited the capture nodes, and fills in the captures from it.
+static int rx_tdfa_match_end (rx_t *rx, matcher_t *m, node_t *node, char *str, int *regs, int pos) {
+    tdfa_t *t = rx->internal->tdfa;
+    m->path_count = 0;
+    for (int tag = 0; tag < t->tags_count - 1; tag += 1) {
+        if (regs[tag] < 0) {
+            continue;
+        }
+        rx_path_push(m, t->tag_nodes[tag], regs[tag]);
+        for (int i = m->path_count - 1; i > 0; i -= 1) {
+            path_t *p1 = m->path + i - 1;
+            path_t *p2 = m->path + i;
+            int rank1 = t->tag_ranks[2 * (p1->node->value - 1) + (p1->node->type == CAPTURE_END)];
+            int rank2 = t->tag_ranks[tag];
+            if (p1->pos < p2->pos || (p1->pos == p2->pos && rank1 < rank2)) {
+                break;
+            }
+            path_t tmp = *p1;
+            *p1 = *p2;
+            *p2 = tmp;
+        }
+    }
+    return rx_match_end(rx, m, node, str, regs[t->tags_count - 1], pos);
+}
+
+// Finds the leftmost-first match at or after start_pos. If it stops for
+// m->cancel or m->time_limit, it sets m->result and fails.
+static int rx_tdfa_match (rx_t *rx, matcher_t *m, int str_size, char *str, int start_pos, long long start_time) {
+    tdfa_t *t = rx->internal->tdfa;
+    int size = t->tags_count * (2 * t->max_threads + 1);
+    if (size > m->internal->regs_allocated) {
+        m->internal->regs_allocated = size;
+        m->internal->regs = realloc(m->internal->regs, m->internal->regs_allocated * sizeof(int));
+    }
+    int *match_regs = m->internal->regs;
+    int *regs = match_regs + t->tags_count;
+    int *regs2 = regs + t->tags_count * t->max_threads;
+    node_t *match = NULL;
+    int match_pos = 0;
+    int state = t->initial[start_pos ? rx_tdfa_prev(str[start_pos - 1]) : TDFA_PREV_SOS];
+    int pos = start_pos;
+
+    // The registers of a match aren't copied until the thread it came from
+    // changes, since something like .* at the end finds a new match each byte.
+    tdfa_trans_t *pending = NULL;
+    int pending_pos = 0;
+    int next_check = pos + RX_CHECK_BYTES;
+    while (1) {
+        if (pos >= next_check) {
+            m->result = rx_limits_time(m, start_time);
+            if (m->result) {
+                return 0;
+            }
+            next_check = pos + RX_CHECK_BYTES;
+        }
+        int stop = str_size < next_check ? str_size : next_check;
+        int offset = state * t->classes_count;
+        while (pos < stop && t->tags_fast[offset + t->classes[(unsigned char) str[pos]]] >= 0) {
+            offset = t->tags_fast[offset + t->classes[(unsigned char) str[pos]]];
+            pos += 1;
+        }
+        state = offset / t->classes_count;
+        if (pos == next_check && pos < str_size) {
+            continue;
+        }
+        tdfa_trans_t *tr;
+        if (pos < str_size) {
+            tr = t->trans + offset + t->classes[(unsigned char) str[pos]];
+        } else {
+            m->hit_end = 1;
+            tr = t->ends + state;
+        }
+        if (tr->match) {
+            match = tr->match;
+            match_pos = pos;
+            pending = tr;
+            pending_pos = pos;
+        }
+        if (tr->target < 0) {
+            break;
+        }
+        state = tr->target;
+        pos += 1;
+        if (tr->identity) {
+            continue;
+        }
+        if (pending) {
+            rx_tdfa_apply(t, match_regs, pending->match_src < 0 ? NULL : regs + pending->match_src * t->tags_count, t->ops + pending->match_ops_start, pending->match_ops_count, pending_pos);
+            pending = NULL;
+        }
+        tdfa_thread_t *threads = t->threads + tr->threads_start;
+        int *dest = tr->in_place ? regs : regs2;
+        for (int i = 0; i < tr->threads_count; i += 1) {
+            tdfa_thread_t *thread = threads + i;
+            if (thread->src != i || thread->ops_count) {
+                rx_tdfa_apply(t, dest + i * t->tags_count, thread->src < 0 ? NULL : regs + thread->src * t->tags_count, t->ops + thread->ops_start, thread->ops_count, pos - 1);
+            } else if (!tr->in_place) {
+                memcpy(dest + i * t->tags_count, regs + i * t->tags_count, t->tags_count * sizeof(int));
+            }
+        }
+        if (!tr->in_place) {
+            regs2 = regs;
+            regs = dest;
+        }
+    }
+    if (!match) {
+        return 0;
+    }
+    if (pending) {
+        rx_tdfa_apply(t, match_regs, pending->match_src < 0 ? NULL : regs + pending->match_src * t->tags_count, t->ops + pending->match_ops_start, pending->match_ops_count, pending_pos);
+    }
+    return rx_tdfa_match_end(rx, m, match, str, match_regs, match_pos);
+}
+
+// Runs the DFA without keeping any registers. Returns where the leftmost-first
+// match ends, or -1. *start is set to where the DFA last had no threads going,
+// no match can start before then. If it stops for m->cancel or m->time_limit, it
+// sets m->result and returns -1.
+static int rx_tdfa_span (rx_t *rx, matcher_t *m, int str_size, char *str, int start_pos, int *start, long long start_time) {
+    tdfa_t *t = rx->internal->tdfa;
+    int state = t->initial[start_pos ? rx_tdfa_prev(str[start_pos - 1]) : TDFA_PREV_SOS];
+    int end = -1;
+    int pos = start_pos;
+    int next_check = pos + RX_CHECK_BYTES;
+    *start = start_pos;
+    while (1) {
+        if (pos >= next_check) {
+            m->result = rx_limits_time(m, start_time);
+            if (m->result) {
+                return -1;
+            }
+            next_check = pos + RX_CHECK_BYTES;
+        }
+        int stop = str_size < next_check ? str_size : next_check;
+        int offset = state * t->classes_count;
+        while (pos < stop && t->span_fast[offset + t->classes[(unsigned char) str[pos]]] >= 0) {
+            offset = t->span_fast[offset + t->classes[(unsigned char) str[pos]]];
+            pos += 1;
+        }
+        state = offset / t->classes_count;
+        if (pos == next_check && pos < str_size) {
+            continue;
+        }
+        tdfa_trans_t *tr;
+        if (pos < str_size) {
+            tr = t->trans + offset + t->classes[(unsigned char) str[pos]];
+        } else {
+            m->hit_end = 1;
+            tr = t->ends + state;
+        }
+        if (tr->match) {
+            end = pos;
+        }
+        if (tr->target < 0) {
+            break;
+        }
+        if (!tr->threads_count && end < 0) {
+            *start = pos + 1;
+            if (rx->plan.anchored_line && pos < str_size && str[pos] != '\n') {
+                // Nothing can start before the next line, and until then the
+                // state is the one it starts in after the byte before.
+                char *p = memchr(str + pos + 1, '\n', str_size - pos - 1);
+                int next = p ? p - str : str_size;
+                if (next > pos + 1) {
+                    state = t->initial[rx_tdfa_prev(str[next - 1])];
+                    pos = next;
+                    *start = pos;
+                    continue;
+                }
+            }
+        }
+        state = tr->target;
+        pos += 1;
+    }
+    return end;
+}
+
+// The reverse program is the node graph with its edges flipped, so it can be run
+// backward from where a match ends to find where it starts. Going backward a byte
+// at a time, it keeps the set of nodes that have a way to the end from the
+// current position, and the consuming nodes among them that can take the byte
+// before it. A start position is where the set has the start node. Both bytes
+// around a position are known by then, so the assertions are checked as they are.
+//
+// A regexp whose matches can only end at the end of the string is searched with
+// it from the end, which only looks at as much of the string as can be part of a
+// match, then the match is redone forward from the start it found to get the
+// captures.
+struct reverse_t {
+    int *preds_start;
+    int *preds;
+    unsigned char *accepts;
+};
+
+static void rx_reverse_free (reverse_t *r) {
+    if (!r) {
+        return;
+    }
+    free(r->preds_start);
+    free(r->preds);
+    free(r->accepts);
+    free(r);
+}
+
+// Fills in the predecessors of each node, the ones for node i are from
+// (*preds)[(*preds_start)[i]] up to (*preds)[(*preds_start)[i + 1]].
+static void rx_node_preds (rx_t *rx, int **preds_start, int **preds) {
+    int *counts = calloc(rx->nodes_count + 1, sizeof(int));
+    for (int i = 0; i < rx->nodes_count; i += 1) {
+        node_t *node = rx->nodes[i];
+        if (node->type == BRANCH) {
+            counts[node->next2->index] += 1;
+        }
+        if (node->type != MATCH_END && node->next) {
+            counts[node->next->index] += 1;
+        }
+    }
+    int *starts = malloc((rx->nodes_count + 1) * sizeof(int));
+    starts[0] = 0;
+    for (int i = 0; i < rx->nodes_count; i += 1) {
+        starts[i + 1] = starts[i] + counts[i];
+        counts[i] = starts[i];
+    }
+    int *list = malloc((starts[rx->nodes_count] + 1) * sizeof(int));
+    for (int i = 0; i < rx->nodes_count; i += 1) {
+        node_t *node = rx->nodes[i];
+        if (node->type == BRANCH) {
+            list[counts[node->next2->index]++] = i;
+        }
+        if (node->type != MATCH_END && node->next) {
+            list[counts[node->next->index]++] = i;
+        }
+    }
+    free(counts);
+    *preds_start = starts;
+    *preds = list;
+}
+
+static void rx_reverse_init (rx_t *rx) {
+    reverse_t *r = calloc(1, sizeof(reverse_t));
+    r->accepts = calloc(rx->nodes_count, 256);
+    for (int i = 0; i < rx->nodes_count; i += 1) {
+        node_t *node = rx->nodes[i];
+        if (rx_node_consumes(node) && !rx_node_bytes(node, r->accepts + 256 * i)) {
+            rx_reverse_free(r);
+            return;
+        }
+        if (node->type == ASSERTION && (node->value == ASSERT_SOS || node->value == ASSERT_SOP)) {
+            // These stop rx_match() from trying other start positions.
+            rx_reverse_free(r);
+            return;
+        }
+        if (node->type == COUNT_START) {
+            // Going backward doesn't know the counter.
+            rx_reverse_free(r);
+            return;
+        }
+    }
+    rx_node_preds(rx, &r->preds_start, &r->preds);
+    rx->internal->reverse = r;
+}
+
+// Returns the leftmost position at or after start_pos that a match ending at end
+// can start from, or -1. If it stops for m->cancel or m->time_limit, it sets
+// m->result and returns -1.
+static int rx_reverse_start (rx_t *rx, matcher_t *m, int str_size, char *str, int start_pos, int end, long long start_time) {
+    reverse_t *r = rx->internal->reverse;
+    int size = 5 * rx->nodes_count;
+    if (size > m->internal->regs_allocated) {
+        m->internal->regs_allocated = size;
+        m->internal->regs = realloc(m->internal->regs, m->internal->regs_allocated * sizeof(int));
+    }
+    // The nodes with a way to the end, the consuming nodes that take the byte
+    // before, a stack, and two lists of those consuming nodes.
+    int *marks = m->internal->regs;
+    int *takes = marks + rx->nodes_count;
+    int *stack = takes + rx->nodes_count;
+    int *list = stack + rx->nodes_count;
+    int *list2 = list + rx->nodes_count;
+    int list_count = 0;
+    memset(marks, 0, 2 * rx->nodes_count * sizeof(int));
+
+    int start = -1;
+    int next_check = end - RX_CHECK_BYTES;
+    for (int pos = end; pos >= start_pos; pos -= 1) {
+        if (pos <= next_check) {
+            m->result = rx_limits_time(m, start_time);
+            if (m->result) {
+                return -1;
+            }
+            next_check = pos - RX_CHECK_BYTES;
+        }
+        int stamp = pos + 1;
+        int stack_count = 0;
+        int list2_count = 0;
+        for (int i = 0; i < list_count; i += 1) {
+            marks[list[i]] = stamp;
+            stack[stack_count] = list[i];
+            stack_count += 1;
+        }
+        if (pos == end) {
+            for (int i = 0; i < rx->nodes_count; i += 1) {
+                if (rx->nodes[i]->type == MATCH_END) {
+                    marks[i] = stamp;
+                    stack[stack_count] = i;
+                    stack_count += 1;
+                }
+            }
+        }
+        while (stack_count) {
+            stack_count -= 1;
+            int index = stack[stack_count];
+            if (rx->nodes[index] == rx->start) {
+                start = pos;
+            }
+            for (int i = r->preds_start[index]; i < r->preds_start[index + 1]; i += 1) {
+                node_t *pred = rx->nodes[r->preds[i]];
+                if (rx_node_consumes(pred)) {
+                    if (pos > start_pos && takes[pred->index] != stamp && r->accepts[256 * pred->index + (unsigned char) str[pos - 1]]) {
+                        takes[pred->index] = stamp;
+                        list2[list2_count] = pred->index;
+                        list2_count += 1;
+                    }
+                } else if (marks[pred->index] != stamp) {
+                    if (pred->type == ASSERTION && !rx_match_assertion(pred->value, start_pos, str_size, str, pos)) {
+                        continue;
+                    }
+                    marks[pred->index] = stamp;
+                    stack[stack_count] = pred->index;
+                    stack_count += 1;
+                }
+            }
+        }
+        if (!list2_count) {
+            break;
+        }
+        int *tmp = list;
+        list = list2;
+        list2 = tmp;
+        list_count = list2_count;
+    }
+    return start;
+}
+
+// Fills in the bytes that going on from node can take first, as a bitmap. It's
+// any byte if the match can end before taking one. With strict set, it's also
+// any byte if there's a ^ or \G on the way, since the backtracker doesn't try
+// anything else when those fail, or the end of an atomic group, which drops the
+// other ways before the byte is looked at. visited is marked with stamp for the
+// nodes it goes through.
+static void rx_first_bytes (rx_t *rx, node_t *node, unsigned char *set, int strict, int *visited, int stamp) {
+    memset(set, 0, 32);
+    rx->dfs_stack_count = 0;
+    rx_dfs_push(rx, node);
+    while (rx->dfs_stack_count) {
+        rx->dfs_stack_count -= 1;
+        node = rx->dfs_stack[rx->dfs_stack_count];
+        if (visited[node->index] == stamp) {
+            continue;
+        }
+        visited[node->index] = stamp;
+        if (node->type == MATCH_END || (strict && node->type == ATOMIC_END) ||
+            (strict && node->type == ASSERTION && (node->value == ASSERT_SOS || node->value == ASSERT_SOP))) {
+            memset(set, 0xff, 32);
+            break;
+        }
+        if (rx_node_consumes(node)) {
+            unsigned char bytes[256];
+            rx_node_bytes(node, bytes);
+            for (int c = 0; c < 256; c += 1) {
+                if (bytes[c]) {
+                    set[c >> 3] |= 1 << (c & 7);
+                }
+            }
+            continue;
+        }
+        // A span is gone through by its next, like the loop it is. Its next2
+        // skips the first time around an X+.
+        rx_dfs_push(rx, node->next);
+        if (node->type == BRANCH) {
+            rx_dfs_push(rx, node->next2);
+        }
+    }
+}
+
+// The plan is which engine and prefilter rx_match() uses, picked from what the
+// other passes built, along with a few things about the node graph that say how
+// much work a match is, which rx_explain() prints.
+//
+// A regexp that starts with ^ and never has more than one way to go at a byte
+// is matched in one pass with the one-pass table. One that ends with $ is run
+// backward from the end of the string first to find where the match starts.
+// Otherwise the tagged DFA is used if it could be built, which is when each
+// capture group is entered at most once or the DFA only has to find where the
+// match is, and it didn't need too many states. Anything else is backtracked.
+// In front of the DFA or the backtracker, the prefilter skips to where the
+// prefix or one of the literals every match starts with is, or from one start
+// of a line to the next when every alternative starts with ^^. With only the
+// backtracker left, the Glushkov automaton rules out strings that can't match,
+// and failing that, a string without the literal every match ends with isn't
+// matched at all.
+static void rx_plan (rx_t *rx) {
+    plan_t *plan = &rx->plan;
+    int *preds_start, *preds;
+    int *visited = calloc(rx->nodes_count, sizeof(int));
+    rx_node_preds(rx, &preds_start, &preds);
+
+    // Matches can only start at the start if every way forward from the start
+    // goes through a ^ or \G before anything else.
+    plan->anchored_start = 1;
+    rx->dfs_stack_count = 0;
+    rx_dfs_push(rx, rx->start);
+    while (rx->dfs_stack_count) {
+        rx->dfs_stack_count -= 1;
+        node_t *node = rx->dfs_stack[rx->dfs_stack_count];
+        if (visited[node->index] == 1) {
+            continue;
+        }
+        visited[node->index] = 1;
+        if (node->type == MATCH_END || rx_node_consumes(node)) {
+            plan->anchored_start = 0;
+            break;
+        }
+        if (node->type == ASSERTION && (node->value == ASSERT_SOS || node->value == ASSERT_SOP)) {
+            continue;
+        }
+        rx_dfs_push(rx, node->next);
+        if (node->type == BRANCH) {
+            rx_dfs_push(rx, node->next2);
+        }
+    }
+
+    // Or at the start of a line if it's through a ^^ instead. A ^ or \G on the
+    // way doesn't count, since the backtracker gives up where one of those
+    // fails, which it wouldn't get to at the positions that are skipped.
+    plan->anchored_line = !plan->anchored_start;
+    rx->dfs_stack_count = 0;
+    rx_dfs_push(rx, rx->start);
+    while (plan->anchored_line && rx->dfs_stack_count) {
+        rx->dfs_stack_count -= 1;
+        node_t *node = rx->dfs_stack[rx->dfs_stack_count];
+        if (visited[node->index] == 4) {
+            continue;
+        }
+        visited[node->index] = 4;
+        if (node->type == MATCH_END || rx_node_consumes(node) ||
+            (node->type == ASSERTION && (node->value == ASSERT_SOS || node->value == ASSERT_SOP))) {
+            plan->anchored_line = 0;
+            break;
+        }
+        if (node->type == ASSERTION && node->value == ASSERT_SOL) {
+            continue;
+        }
+        rx_dfs_push(rx, node->next);
+        if (node->type == BRANCH || node->type == SPAN || node->type == SPAN_LAZY) {
+            rx_dfs_push(rx, node->next2);
+        }
+    }
+
+    // And they can only end at the end of the string if every way back from
+    // the match end goes through a $ before anything else.
+    plan->anchored_end = 1;
+    rx->dfs_stack_count = 0;
+    for (int i = 0; i < rx->nodes_count; i += 1) {
+        if (rx->nodes[i]->type == MATCH_END) {
+            rx_dfs_push(rx, rx->nodes[i]);
+        }
+    }
+    while (rx->dfs_stack_count) {
+        rx->dfs_stack_count -= 1;
+        node_t *node = rx->dfs_stack[rx->dfs_stack_count];
+        if (visited[node->index] == 2) {
+            continue;
+        }
+        visited[node->index] = 2;
+        if (node == rx->start || rx_node_consumes(node)) {
+            plan->anchored_end = 0;
+            break;
+        }
+        if (node->type == ASSERTION && node->value == ASSERT_EOS) {
+            continue;
+        }
+        for (int i = preds_start[node->index]; i < preds_start[node->index + 1]; i += 1) {
+            rx_dfs_push(rx, rx->nodes[preds[i]]);
+        }
+    }
+
+    // The bytes a match can start with are the ones the first consuming nodes
+    // take, or any byte if the match can be empty.
+    rx_first_bytes(rx, rx->start, plan->first_bytes, 0, visited, 3);
+
+    // The fewest bytes a match can have, each consuming node on the way to the
+    // end being at least one.
+    int *dist = visited;
+    for (int i = 0; i < rx->nodes_count; i += 1) {
+        dist[i] = -1;
+    }
+    dist[rx->start->index] = 0;
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (int i = 0; i < rx->nodes_count; i += 1) {
+            node_t *node = rx->nodes[i];
+            if (dist[i] < 0 || node->type == MATCH_END) {
+                continue;
+            }
+            int d = dist[i] + rx_node_consumes(node);
+            node_t *nexts[2] = {node->next, node->type == BRANCH ? node->next2 : NULL};
+            for (int j = 0; j < 2; j += 1) {
+                if (nexts[j] && (dist[nexts[j]->index] < 0 || d < dist[nexts[j]->index])) {
+                    dist[nexts[j]->index] = d;
+                    changed = 1;
+                }
+            }
+        }
+    }
+    plan->min_size = -1;
+    for (int i = 0; i < rx->nodes_count; i += 1) {
+        if (rx->nodes[i]->type == MATCH_END && dist[i] >= 0 && (plan->min_size < 0 || dist[i] < plan->min_size)) {
+            plan->min_size = dist[i];
+        }
+    }
+    if (plan->min_size < 0) {
+        plan->min_size = 0;
+    }
+
+    // The string every match ends with comes from going back from the match
+    // end for as long as there's only one way to have gotten there.
+    plan->suffix_size = 0;
+    plan->suffix = realloc(plan->suffix, rx->nodes_count + 1);
+    node_t *node = NULL;
+    int ends = 0;
+    for (int i = 0; i < rx->nodes_count; i += 1) {
+        if (rx->nodes[i]->type == MATCH_END) {
+            node = rx->nodes[i];
+            ends += 1;
+        }
+    }
+    if (ends != 1) {
+        node = NULL;
+    }
+    for (int steps = 0; node && steps < rx->nodes_count; steps += 1) {
+        if (node->type == TAKE) {
+            plan->suffix[rx->nodes_count - 1 - plan->suffix_size] = node->value;
+            plan->suffix_size += 1;
+        } else if (rx_node_consumes(node)) {
+            break;
+        }
+        if (node == rx->start || preds_start[node->index + 1] - preds_start[node->index] != 1) {
+            break;
+        }
+        node = rx->nodes[preds[preds_start[node->index]]];
+    }
+    memmove(plan->suffix, plan->suffix + rx->nodes_count - plan->suffix_size, plan->suffix_size);
+
+    // When the backtracker could be slow for the regexp, it remembers where it's
+    // been from the start, instead of once it's been slow.
+    plan->memoize = rx->complexity > COMPLEXITY_LINEAR;
+
+    if (rx->internal->onepass) {
+        plan->engine = ENGINE_ONEPASS;
+    } else if (rx->internal->reverse && plan->anchored_end) {
+        plan->engine = ENGINE_REVERSE;
+    } else if (rx->internal->tdfa) {
+        plan->engine = ENGINE_DFA;
+        if (rx->internal->prefix_size && !rx->internal->tdfa->anchored) {
+            plan->prefilter = PREFILTER_PREFIX;
+        } else if (rx->internal->literals && !rx->internal->tdfa->anchored) {
+            plan->prefilter = PREFILTER_LITERALS;
+        } else if (plan->anchored_line) {
+            plan->prefilter = PREFILTER_LINES;
+        }
+    } else {
+        plan->engine = ENGINE_BACKTRACKER;
+        if (rx->internal->prefix_size) {
+            plan->prefilter = PREFILTER_PREFIX;
+        } else if (rx->internal->literals) {
+            plan->prefilter = PREFILTER_LITERALS;
+        } else if (plan->anchored_line) {
+            plan->prefilter = PREFILTER_LINES;
+        } else if (rx->internal->glushkov) {
+            plan->prefilter = PREFILTER_GLUSHKOV;
+        } else if (plan->suffix_size) {
+            plan->prefilter = PREFILTER_SUFFIX;
+        }
+    }
+
+    free(visited);
+    free(preds_start);
+    free(preds);
+}
+
+// Returns the node that going to node ends up at, past the nodes that don't do
+// anything, and the branches that go the same way both ways.
+static node_t *rx_skip_empty (rx_t *rx, node_t *node) {
+    for (int steps = 0; steps < rx->nodes_count && node->next; steps += 1) {
+        if (node->type != EMPTY && node->type != GROUP_START && node->type != GROUP_END &&
+            !(node->type == BRANCH && node->next == node->next2)) {
+            break;
+        }
+        node = node->next;
+    }
+    return node;
+}
+
+// Frees the nodes there's no longer a way to, and numbers the rest.
+static void rx_sweep (rx_t *rx) {
+    for (int i = 0; i < rx->nodes_count; i += 1) {
+        rx->nodes[i]->index = i;
+    }
+    char *reachable = calloc(rx->nodes_count, 1);
+    rx->dfs_stack_count = 0;
+    rx_dfs_push(rx, rx->start);
+    while (rx->dfs_stack_count) {
+        rx->dfs_stack_count -= 1;
+        node_t *node = rx->dfs_stack[rx->dfs_stack_count];
+        if (reachable[node->index]) {
+            continue;
+        }
+        reachable[node->index] = 1;
+        if (node->type == BRANCH || node->type == SPAN || node->type == SPAN_LAZY) {
+            rx_dfs_push(rx, node->next2);
+        }
+        if (node->type != MATCH_END) {
+            rx_dfs_push(rx, node->next);
+        }
+    }
+    int count = 0;
+    for (int i = 0; i < rx->nodes_count; i += 1) {
+        if (reachable[i]) {
+            rx->nodes[count] = rx->nodes[i];
+            rx->nodes[count]->index = count;
+            count += 1;
+        } else {
+            free(rx->nodes[i]);
+        }
+    }
+    rx->nodes_count = count;
+    free(reachable);
+}
+
+// Alternatives are tried in order, so (a|b)|c is the same as a|(b|c), and the
+// alternatives next to each other that start with the same character can share
+// it, so ab|ac|d is the same as a(?:b|c)|d. This turns the branches rx_init()
+// makes for a|b|c, which are (a|b)|c, into a|(b|c), so the first alternative
+// is always next and the rest are a chain of next2, then factors out the
+// characters those start with. Only the alternatives next to each other are
+// factored, going ahead of the ones in between would change which match is
+// found first. The branches of spans and counted loops are left as they are,
+// since those go by what's at their next and next2. Returns 1 if it left
+// nodes with no way to them.
+static int rx_factor (rx_t *rx) {
+    int *preds = calloc(rx->nodes_count, sizeof(int));
+    char *fixed = calloc(rx->nodes_count, 1);
+    preds[rx->start->index] = 1;
+    for (int i = 0; i < rx->nodes_count; i += 1) {
+        node_t *node = rx->nodes[i];
+        if (node->type == BRANCH || node->type == SPAN || node->type == SPAN_LAZY) {
+            preds[node->next2->index] += 1;
+        }
+        if (node->type != MATCH_END && node->next) {
+            preds[node->next->index] += 1;
+            if (node->type == SPAN || node->type == SPAN_LAZY || node->type == COUNT) {
+                fixed[node->next->index] = 1;
+            }
+        }
+    }
+
+    // None of the changes make a node have a different number of ways to it,
+    // except for the ones there's no longer a way to.
+    int factored = 0;
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (int i = 0; i < rx->nodes_count; i += 1) {
+            node_t *node = rx->nodes[i];
+            if (node->type != BRANCH || fixed[i] || preds[i] == 0) {
+                continue;
+            }
+            node_t *node2 = node->next;
+            if (node2->type == BRANCH && preds[node2->index] == 1 && node2 != node) {
+                // (a|b)|c becomes a|(b|c)
+                node_t *c = node->next2;
+                node->next = node2->next;
+                node->next2 = node2;
+                node2->next = node2->next2;
+                node2->next2 = c;
+                changed = 1;
+                continue;
+            }
+            if ((node2->type != TAKE && node2->type != TAKE_NOCASE) || preds[node2->index] != 1) {
+                continue;
+            }
+            node_t *node3 = node->next2;
+            node_t *rest = NULL;
+            if (node3->type == BRANCH && preds[node3->index] == 1 && node3 != node) {
+                rest = node3;
+                node3 = node3->next;
+            }
+            if (node3 == node2 || node3->type != node2->type || node3->value != node2->value ||
+                preds[node3->index] != 1) {
+                continue;
+            }
+            if (rest) {
+                // ab|ac|d becomes a(?:b|c)|d, the branch that was for ac|d
+                // is the one for b|c now.
+                node->next2 = rest->next2;
+                rest->next = node2->next;
+                rest->next2 = node3->next;
+                node2->next = rest;
+            } else {
+                // ab|ac becomes a(?:b|c), the branch and the first a trade
+                // places.
+                int type = node2->type;
+                int value = node2->value;
+                node2->type = BRANCH;
+                node2->next2 = node3->next;
+                node->type = type;
+                node->value = value;
+            }
+            preds[node3->index] = 0;
+            changed = 1;
+            factored = 1;
+        }
+    }
+    free(preds);
+    free(fixed);
+    return factored;
+}
+
+// Makes the node graph smaller before anything else looks at it. Every way to
+// a node that doesn't do anything goes to where it leads instead, then the
+// nodes there's no longer a way to are freed. That also numbers the nodes.
+static void rx_optimize (rx_t *rx) {
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (int i = 0; i < rx->nodes_count; i += 1) {
+            node_t *node = rx->nodes[i];
+            node_t *next;
+            if (node->type == MATCH_END || node->type == COUNT || !node->next) {
+                // A counter goes by where the branch after it goes.
+                continue;
+            }
+            next = rx_skip_empty(rx, node->next);
+            changed |= next != node->next;
+            node->next = next;
+            if (node->type == BRANCH || node->type == SPAN || node->type == SPAN_LAZY) {
+                next = rx_skip_empty(rx, node->next2);
+                changed |= next != node->next2;
+                node->next2 = next;
+            }
+        }
+    }
+    rx->start = rx_skip_empty(rx, rx->start);
+    rx_sweep(rx);
+    if (rx_factor(rx)) {
+        rx_sweep(rx);
+    }
+}
+
+// A run is TAKE and TAKE_NOCASE nodes one after the other, with no way into
+// the middle of it but from the one before. The backtracker compares the whole
+// run at once when it gets to the first one, instead of a byte at a time. For
+// each node that a run starts at, size is how many bytes it has, which are in
+// str at offset, and next is the node after it. fold is or'd with the string
+// before comparing for the ones that ignore case, and nocase says if there
+// are any of those.
+struct runs_t {
+    int *size;
+    int *offset;
+    char *nocase;
+    node_t **next;
+    char *str;
+    char *fold;
+};
+
+static void rx_runs_free (runs_t *runs) {
+    if (!runs) {
+        return;
+    }
+    free(runs->size);
+    free(runs->offset);
+    free(runs->nocase);
+    free(runs->next);
+    free(runs->str);
+    free(runs->fold);
+    free(runs);
+}
+
+static void rx_runs_init (rx_t *rx) {
+    int *preds_start, *preds;
+    rx_node_preds(rx, &preds_start, &preds);
+    runs_t *runs = calloc(1, sizeof(runs_t));
+    runs->size = calloc(rx->nodes_count, sizeof(int));
+    runs->offset = calloc(rx->nodes_count, sizeof(int));
+    runs->nocase = calloc(rx->nodes_count, 1);
+    runs->next = calloc(rx->nodes_count, sizeof(node_t *));
+    runs->str = malloc(rx->nodes_count);
+    runs->fold = malloc(rx->nodes_count);
+    int str_size = 0;
+    int found = 0;
+    for (int i = 0; i < rx->nodes_count; i += 1) {
+        node_t *node = rx->nodes[i];
+        if (node->type != TAKE && node->type != TAKE_NOCASE) {
+            continue;
+        }
+        // Only the first node of a run starts one, the rest are only
+        // gotten to from the one before.
+        if (node != rx->start && preds_start[i + 1] - preds_start[i] == 1) {
+            node_t *pred = rx->nodes[preds[preds_start[i]]];
+            if (pred->type == TAKE || pred->type == TAKE_NOCASE) {
+                continue;
+            }
+        }
+        int size = 0;
+        int offset = str_size;
+        char nocase = 0;
+        node_t *node2 = node;
+        while (1) {
+            runs->str[str_size] = node2->value;
+            runs->fold[str_size] = node2->type == TAKE_NOCASE ? 0x20 : 0;
+            nocase |= node2->type == TAKE_NOCASE;
+            str_size += 1;
+            size += 1;
+            node2 = node2->next;
+            int j = node2->index;
+            if ((node2->type != TAKE && node2->type != TAKE_NOCASE) ||
+                node2 == rx->start || preds_start[j + 1] - preds_start[j] != 1) {
+                break;
+            }
+        }
+        if (size > 1) {
+            runs->size[i] = size;
+            runs->offset[i] = offset;
+            runs->nocase[i] = nocase;
+            runs->next[i] = node2;
+            found = 1;
+        }
+    }
+    free(preds_start);
+    free(preds);
+    if (!found) {
+        rx_runs_free(runs);
+        runs = NULL;
+    }
+    rx->internal->runs = runs;
+}
+
+// Returns 1 if the run starting at node matches the string with its second
+// byte at pos, 0 if it doesn't, and -1 if it matches up to the end of the
+// string but needs more. The first byte was already compared by the node.
+static int rx_run_match (runs_t *runs, node_t *node, int str_size, char *str, int pos) {
+    int size = runs->size[node->index] - 1;
+    int hit_end = 0;
+    if (str_size - pos < size) {
+        size = str_size - pos;
+        hit_end = 1;
+    }
+    char *str2 = runs->str + runs->offset[node->index] + 1;
+    if (runs->nocase[node->index]) {
+        char *fold = runs->fold + runs->offset[node->index] + 1;
+        for (int i = 0; i < size; i += 1) {
+            if ((str[pos + i] | fold[i]) != str2[i]) {
+                return 0;
+            }
+        }
+    } else if (memcmp(str + pos, str2, size) != 0) {
+        return 0;
+    }
+    return hit_end ? -1 : 1;
+}
+
+// A branch's jump table says, for each byte that could be next in the string,
+// which way from the branch can start with it. The branch and the ones that are
+// its next2, one after the other, are a chain of alternatives, and the entry is
+// the first branch in the chain whose next can start with the byte, or the node
+// the chain ends at, or NULL if nothing can. The backtracker goes straight
+// there instead of trying each alternative in turn. Only the branches with a
+// way that can't start with some byte get one.
+struct dispatch_t {
+    int count;
+    int nodes_count;
+    node_t ***jump;
+};
+
+static void rx_dispatch_free (dispatch_t *d) {
+    if (!d) {
+        return;
+    }
+    for (int i = 0; i < d->nodes_count; i += 1) {
+        free(d->jump[i]);
+    }
+    free(d->jump);
+    free(d);
+}
+
+static void rx_dispatch_init (rx_t *rx) {
+    dispatch_t *d = calloc(1, sizeof(dispatch_t));
+    d->nodes_count = rx->nodes_count;
+    d->jump = calloc(rx->nodes_count, sizeof(node_t **));
+    unsigned char *sets = malloc(rx->nodes_count * 32);
+    char *done = calloc(rx->nodes_count, 1);
+    int *visited = calloc(rx->nodes_count, sizeof(int));
+    int stamp = 0;
+    node_t **jump = malloc(256 * sizeof(node_t *));
+    node_t **chain = malloc(rx->nodes_count * sizeof(node_t *));
+
+    for (int i = 0; i < rx->nodes_count; i += 1) {
+        node_t *node = rx->nodes[i];
+        if (node->type != BRANCH) {
+            continue;
+        }
+        // The ways from the chain, in the order they're tried.
+        int chain_count = 0;
+        while (node->type == BRANCH && chain_count < rx->nodes_count) {
+            chain[chain_count] = node;
+            chain_count += 1;
+            node = node->next2;
+        }
+        if (node->type == BRANCH) {
+            // The chain goes around in a circle.
+            continue;
+        }
+        chain[chain_count] = node;
+        for (int j = 0; j <= chain_count; j += 1) {
+            node_t *first = j < chain_count ? chain[j]->next : chain[j];
+            if (!done[first->index]) {
+                stamp += 1;
+                rx_first_bytes(rx, first, sets + 32 * first->index, 1, visited, stamp);
+                done[first->index] = 1;
+            }
+        }
+        int useful = 0;
+        for (int c = 0; c < 256; c += 1) {
+            jump[c] = NULL;
+            for (int j = 0; j <= chain_count; j += 1) {
+                node_t *first = j < chain_count ? chain[j]->next : chain[j];
+                if (sets[32 * first->index + (c >> 3)] & (1 << (c & 7))) {
+                    jump[c] = chain[j];
+                    break;
+                }
+            }
+            useful |= jump[c] != chain[0];
+        }
+        if (useful) {
+            d->jump[i] = jump;
+            d->count += 1;
+            jump = malloc(256 * sizeof(node_t *));
+        }
+    }
+
+    free(jump);
+    free(chain);
+    free(sets);
+    free(done);
+    free(visited);
+    if (!d->count) {
+        rx_dispatch_free(d);
+        d = NULL;
+    }
+    rx->internal->dispatch = d;
+}
+
+// A set of bytes laid out for the scanning kernels. Byte c is in it when bit
+// (c >> 4) & 7 of lo[c & 15] is set for c below 0x80, or of hi[c & 15] for the
+// rest. That's a table lookup by each half of the byte, which the vector
+// kernels do 16 or 32 bytes at a time with a shuffle.
+typedef struct {
+    unsigned char lo[16];
+    unsigned char hi[16];
+} byteset_t;
+
+// Makes a byteset from a bitmap of 32 bytes.
+static void rx_byteset_init (byteset_t *set, unsigned char *bits) {
+    memset(set, 0, sizeof(byteset_t));
+    for (int c = 0; c < 256; c += 1) {
+        if (bits[c >> 3] & (1 << (c & 7))) {
+            unsigned char *row = c < 0x80 ? set->lo : set->hi;
+            row[c & 15] |= 1 << ((c >> 4) & 7);
+        }
+    }
+}
+
+static int rx_byteset_has (const byteset_t *set, unsigned char c) {
+    const unsigned char *row = c < 0x80 ? set->lo : set->hi;
+    return (row[c & 15] >> ((c >> 4) & 7)) & 1;
+}
+
+// Returns the first position from pos, up to end, whose byte is in the set if
+// member is 1, or isn't if it's 0. Returns end if there's none. The kernels
+// below are all this, one 16 or 32 bytes at a time, and rx_scan() is whichever
+// the cpu it runs on can do.
+static int rx_scan_bytes (const byteset_t *set, const char *str, int pos, int end, int member) {
+    while (pos < end && rx_byteset_has(set, str[pos]) != member) {
+        pos += 1;
+    }
+    return pos;
+}
+
+#ifdef RX_X86
+// A byte's row is the lo table shuffled by it, which gives 0 when its top bit
+// is set, or'd with the hi table shuffled by it with the top bit flipped. Its
+// column is 1 << (c >> 4) & 7, also a shuffle. It's in the set when those have
+// a bit in common.
+__attribute__((target("ssse3")))
+static int rx_scan_ssse3 (const byteset_t *set, const char *str, int pos, int end, int member) {
+    __m128i lo = _mm_loadu_si128((const __m128i *) set->lo);
+    __m128i hi = _mm_loadu_si128((const __m128i *) set->hi);
+    __m128i bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+    __m128i nibble = _mm_set1_epi8(0x0f);
+    __m128i top = _mm_set1_epi8(-128);
+    unsigned int flip = member ? 0xffff : 0;
+    for (; pos + 16 <= end; pos += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (str + pos));
+        __m128i row = _mm_or_si128(_mm_shuffle_epi8(lo, v), _mm_shuffle_epi8(hi, _mm_xor_si128(v, top)));
+        __m128i col = _mm_shuffle_epi8(bits, _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+        __m128i out = _mm_cmpeq_epi8(_mm_and_si128(row, col), _mm_setzero_si128());
+        unsigned int mask = (unsigned int) _mm_movemask_epi8(out) ^ flip;
+        if (mask) {
+            return pos + __builtin_ctz(mask);
+        }
+    }
+    return rx_scan_bytes(set, str, pos, end, member);
+}
+
+// The same as rx_scan_ssse3(), with both halves of the registers doing it.
+__attribute__((target("avx2")))
+static int rx_scan_avx2 (const byteset_t *set, const char *str, int pos, int end, int member) {
+    __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) set->lo));
+    __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) set->hi));
+    __m256i bits = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128,
+                                    1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+    __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i top = _mm256_set1_epi8(-128);
+    unsigned int flip = member ? 0xffffffff : 0;
+    for (; pos + 32 <= end; pos += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (str + pos));
+        __m256i row = _mm256_or_si256(_mm256_shuffle_epi8(lo, v), _mm256_shuffle_epi8(hi, _mm256_xor_si256(v, top)));
+        __m256i col = _mm256_shuffle_epi8(bits, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+        __m256i out = _mm256_cmpeq_epi8(_mm256_and_si256(row, col), _mm256_setzero_si256());
+        unsigned int mask = (unsigned int) _mm256_movemask_epi8(out) ^ flip;
+        if (mask) {
+            return pos + __builtin_ctz(mask);
+        }
+    }
+    return rx_scan_ssse3(set, str, pos, end, member);
+}
+#endif
+
+// Which of the kernels the cpu can run, 2 for AVX2, 1 for SSSE3, or 0 for
+// neither, worked out the first time it's asked. Threads that race here all
+// work out the same.
+static int rx_cpu_level (void) {
+    static int level = -1;
+    if (level < 0) {
+        int l = 0;
+#ifdef RX_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            l = 2;
+        } else if (__builtin_cpu_supports("ssse3")) {
+            l = 1;
+        }
+#endif
+        level = l;
+    }
+    return level;
+}
+
+static int rx_scan (const byteset_t *set, const char *str, int pos, int end, int member) {
+#ifdef RX_X86
+    int level = rx_cpu_level();
+    if (level == 2) {
+        return rx_scan_avx2(set, str, pos, end, member);
+    } else if (level == 1) {
+        return rx_scan_ssse3(set, str, pos, end, member);
+    }
+#endif
+    return rx_scan_bytes(set, str, pos, end, member);
+}
+
+// The bytesets rx_span() runs the kernels with, for each node that consumes.
+// A character class only has its ascii characters in it, the rest go through
+// rx_match_char_class() a character at a time. first is the bytes a match can
+// start with, which rx_match() skips to, or NULL when it could be anything.
+struct scans_t {
+    byteset_t *sets;
+    byteset_t *first;
+};
+
+static void rx_scans_free (scans_t *s) {
+    if (!s) {
+        return;
+    }
+    free(s->sets);
+    free(s->first);
+    free(s);
+}
+
+static void rx_scans_init (rx_t *rx) {
+    scans_t *s = calloc(1, sizeof(scans_t));
+    s->sets = calloc(rx->nodes_count, sizeof(byteset_t));
+    for (int i = 0; i < rx->nodes_count; i += 1) {
+        node_t *node = rx->nodes[i];
+        if (!rx_node_consumes(node)) {
+            continue;
+        }
+        unsigned char bits[32];
+        if (node->type == CHAR_CLASS) {
+            memcpy(bits, node->ccval->bytes, 16);
+            memset(bits + 16, 0, 16);
+        } else {
+            unsigned char bytes[256];
+            rx_node_bytes(node, bytes);
+            memset(bits, 0, 32);
+            for (int c = 0; c < 256; c += 1) {
+                if (bytes[c]) {
+                    bits[c >> 3] |= 1 << (c & 7);
+                }
+            }
+        }
+        rx_byteset_init(&s->sets[i], bits);
+    }
+
+    // Strict, since a ^ or \G that fails stops the backtracker, and it
+    // wouldn't get to one at the positions it skips.
+    unsigned char first[32];
+    int *visited = calloc(rx->nodes_count, sizeof(int));
+    rx_first_bytes(rx, rx->start, first, 1, visited, 1);
+    free(visited);
+    if (rx->char_classes_count) {
+        // A class looks at a cut off utf8 character to say if the match hit
+        // the end, even when it doesn't match any of them.
+        memset(first + 24, 0xff, 8);
+    }
+    int all = 1;
+    for (int i = 0; i < 32; i += 1) {
+        all &= first[i] == 0xff;
+    }
+    if (!all) {
+        s->first = malloc(sizeof(byteset_t));
+        rx_byteset_init(s->first, first);
+    }
+    rx->internal->scans = s;
+}
+
+#define RX_LITERALS_MAX 64
+#define RX_LITERAL_SIZE 8
+
+// The literals one of which every match starts with, when there isn't just
+// one, like with (ERROR|WARN|FATAL):. Each is at most RX_LITERAL_SIZE bytes
+// from the start of the ones the regexp has there, and they're sorted and put
+// into 8 buckets, the ones from bucket_start[b] to bucket_start[b + 1] being
+// in bucket b.
+//
+// They're found with the Teddy trick. For each of the first width bytes of a
+// literal, the bit for its bucket is set in masks[k][0] by the low half of the
+// byte and in masks[k][1] by the high half. The masks for the bytes in the
+// string and after it, and'd together, have the buckets that could have a
+// literal starting there, which is a shuffle for each half of 16 or 32 bytes
+// at a time. Only those buckets' literals are compared.
+struct literals_t {
+    int count;
+    int size[RX_LITERALS_MAX];
+    char str[RX_LITERALS_MAX][RX_LITERAL_SIZE];
+    char fold[RX_LITERALS_MAX][RX_LITERAL_SIZE];
+    int bucket_start[9];
+    int width;
+    unsigned char masks[3][2][16];
+};
+
+// A literal being found, with node being where it goes on from, and the
+// branches it went through to get there.
+typedef struct {
+    node_t *node;
+    int size;
+    char str[RX_LITERAL_SIZE];
+    char fold[RX_LITERAL_SIZE];
+    int branches_count;
+    node_t *branches[16];
+} literal_t;
+
+static int rx_literal_compare (const void *a, const void *b) {
+    const literal_t *l1 = a, *l2 = b;
+    int size = l1->size < l2->size ? l1->size : l2->size;
+    int c = memcmp(l1->str, l2->str, size);
+    return c ? c : l1->size - l2->size;
+}
+
+// Goes every way from the start up to the first thing that isn't a literal
+// character, which gives the literals a match can start with. There aren't
+// any if one of them would be shorter than 2 bytes, or there would be too
+// many of them.
+static void rx_literals_init (rx_t *rx) {
+    literal_t *found = malloc(RX_LITERALS_MAX * sizeof(literal_t));
+    literal_t *todo = malloc(RX_LITERALS_MAX * sizeof(literal_t));
+    int found_count = 0;
+    int todo_count = 1;
+    memset(todo, 0, sizeof(literal_t));
+    todo[0].node = rx->start;
+    int ok = 1;
+    int steps = 0;
+    while (ok && todo_count) {
+        todo_count -= 1;
+        literal_t lit = todo[todo_count];
+        node_t *node = lit.node;
+        while (lit.size < RX_LITERAL_SIZE) {
+            steps += 1;
+            if (steps > 64 * RX_LITERALS_MAX) {
+                // Going around a loop that doesn't take anything.
+                ok = 0;
+                break;
+            }
+            if (node->type == TAKE || node->type == TAKE_NOCASE) {
+                lit.str[lit.size] = node->value;
+                lit.fold[lit.size] = node->type == TAKE_NOCASE ? 0x20 : 0;
+                lit.size += 1;
+            } else if (node->type == BRANCH) {
+                // A literal ends where it would go around a loop again, so
+                // (?:foo|bar)+x is just foo and bar.
+                int seen = lit.branches_count == 16;
+                for (int i = 0; i < lit.branches_count && !seen; i += 1) {
+                    seen = lit.branches[i] == node;
+                }
+                if (seen) {
+                    break;
+                }
+                lit.branches[lit.branches_count] = node;
+                lit.branches_count += 1;
+                if (found_count + todo_count + 1 >= RX_LITERALS_MAX) {
+                    ok = 0;
+                    break;
+                }
+                todo[todo_count] = lit;
+                todo[todo_count].node = node->next2;
+                todo_count += 1;
+            } else if (node->type == ASSERTION && (node->value == ASSERT_SOS || node->value == ASSERT_SOP)) {
+                // A ^ or \G that fails stops the backtracker, and it wouldn't
+                // get to one at the positions that are skipped.
+                ok = 0;
+                break;
+            } else if (node->type != EMPTY && node->type != GROUP_START &&
+                       node->type != GROUP_END && node->type != CAPTURE_START &&
+                       node->type != CAPTURE_END && node->type != ASSERTION &&
+                       node->type != ATOMIC_START && node->type != ATOMIC_END) {
+                break;
+            }
+            node = node->next;
+        }
+        if (!ok || lit.size < 2 || found_count == RX_LITERALS_MAX) {
+            ok = 0;
+            break;
+        }
+        found[found_count] = lit;
+        found_count += 1;
+    }
+    free(todo);
+    if (!ok) {
+        free(found);
+        return;
+    }
+
+    // A literal that starts with another one doesn't need to be looked for.
+    qsort(found, found_count, sizeof(literal_t), rx_literal_compare);
+    literals_t *l = calloc(1, sizeof(literals_t));
+    l->width = 3;
+    for (int i = 0; i < found_count; i += 1) {
+        int dup = 0;
+        for (int j = 0; j < l->count && !dup; j += 1) {
+            dup = l->size[j] <= found[i].size && memcmp(l->str[j], found[i].str, l->size[j]) == 0 &&
+                  memcmp(l->fold[j], found[i].fold, l->size[j]) == 0;
+        }
+        if (dup) {
+            continue;
+        }
+        l->size[l->count] = found[i].size;
+        memcpy(l->str[l->count], found[i].str, RX_LITERAL_SIZE);
+        memcpy(l->fold[l->count], found[i].fold, RX_LITERAL_SIZE);
+        l->width = found[i].size < l->width ? found[i].size : l->width;
+        l->count += 1;
+    }
+    free(found);
+
+    for (int b = 0; b <= 8; b += 1) {
+        l->bucket_start[b] = b * l->count / 8;
+    }
+    for (int b = 0; b < 8; b += 1) {
+        for (int i = l->bucket_start[b]; i < l->bucket_start[b + 1]; i += 1) {
+            for (int k = 0; k < l->width; k += 1) {
+                unsigned char c = l->str[i][k];
+                unsigned char c2 = l->fold[i][k] ? c & ~0x20 : c;
+                l->masks[k][0][c & 15] |= 1 << b;
+                l->masks[k][1][c >> 4] |= 1 << b;
+                l->masks[k][0][c2 & 15] |= 1 << b;
+                l->masks[k][1][c2 >> 4] |= 1 << b;
+            }
+        }
+    }
+    rx->internal->literals = l;
+}
+
+// Returns if one of the literals in the buckets is at pos.
+static int rx_literals_check (literals_t *l, unsigned int buckets, int str_size, char *str, int pos) {
+    for (int b = 0; b < 8; b += 1) {
+        if (!(buckets & (1 << b))) {
+            continue;
+        }
+        for (int i = l->bucket_start[b]; i < l->bucket_start[b + 1]; i += 1) {
+            if (pos + l->size[i] > str_size) {
+                continue;
+            }
+            int j;
+            for (j = 0; j < l->size[i]; j += 1) {
+                if ((str[pos + j] | l->fold[i][j]) != l->str[i][j]) {
+                    break;
+                }
+            }
+            if (j == l->size[i]) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int rx_literals_find_bytes (literals_t *l, int str_size, char *str, int pos) {
+    for (; pos + l->width <= str_size; pos += 1) {
+        unsigned int buckets = 0xff;
+        for (int k = 0; k < l->width; k += 1) {
+            unsigned char c = str[pos + k];
+            buckets &= l->masks[k][0][c & 15] & l->masks[k][1][c >> 4];
+        }
+        if (buckets && rx_literals_check(l, buckets, str_size, str, pos)) {
+            return pos;
+        }
+    }
+    return -1;
+}
+
+#ifdef RX_X86
+__attribute__((target("ssse3")))
+static int rx_literals_find_ssse3 (literals_t *l, int str_size, char *str, int pos) {
+    __m128i nibble = _mm_set1_epi8(0x0f);
+    for (; pos + 16 + l->width - 1 <= str_size; pos += 16) {
+        __m128i buckets = _mm_set1_epi8(-1);
+        for (int k = 0; k < l->width; k += 1) {
+            __m128i v = _mm_loadu_si128((const __m128i *) (str + pos + k));
+            __m128i lo = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) l->masks[k][0]), _mm_and_si128(v, nibble));
+            __m128i hi = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) l->masks[k][1]), _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+            buckets = _mm_and_si128(buckets, _mm_and_si128(lo, hi));
+        }
+        unsigned int mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(buckets, _mm_setzero_si128())) & 0xffff;
+        if (!mask) {
+            continue;
+        }
+        unsigned char b[16];
+        _mm_storeu_si128((__m128i *) b, buckets);
+        for (; mask; mask &= mask - 1) {
+            int i = __builtin_ctz(mask);
+            if (rx_literals_check(l, b[i], str_size, str, pos + i)) {
+                return pos + i;
+            }
+        }
+    }
+    return rx_literals_find_bytes(l, str_size, str, pos);
+}
+
+__attribute__((target("avx2")))
+static int rx_literals_find_avx2 (literals_t *l, int str_size, char *str, int pos) {
+    __m256i nibble = _mm256_set1_epi8(0x0f);
+    for (; pos + 32 + l->width - 1 <= str_size; pos += 32) {
+        __m256i buckets = _mm256_set1_epi8(-1);
+        for (int k = 0; k < l->width; k += 1) {
+            __m256i v = _mm256_loadu_si256((const __m256i *) (str + pos + k));
+            __m256i lo = _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) l->masks[k][0])), _mm256_and_si256(v, nibble));
+            __m256i hi = _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) l->masks[k][1])), _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+            buckets = _mm256_and_si256(buckets, _mm256_and_si256(lo, hi));
+        }
+        unsigned int mask = ~(unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(buckets, _mm256_setzero_si256()));
+        if (!mask) {
+            continue;
+        }
+        unsigned char b[32];
+        _mm256_storeu_si256((__m256i *) b, buckets);
+        for (; mask; mask &= mask - 1) {
+            int i = __builtin_ctz(mask);
+            if (rx_literals_check(l, b[i], str_size, str, pos + i)) {
+                return pos + i;
+            }
+        }
+    }
+    return rx_literals_find_ssse3(l, str_size, str, pos);
+}
+#endif
+
+// Returns the first position at or after pos where one of the literals is, or
+// -1 if there's none.
+static int rx_literals_find (literals_t *l, int str_size, char *str, int pos) {
+#ifdef RX_X86
+    int level = rx_cpu_level();
+    if (level == 2) {
+        return rx_literals_find_avx2(l, str_size, str, pos);
+    } else if (level == 1) {
+        return rx_literals_find_ssse3(l, str_size, str, pos);
+    }
+#endif
+    return rx_literals_find_bytes(l, str_size, str, pos);
+}
+
+// The most consuming nodes rx_analyze() looks at, and the most ways between
+// pairs of them it makes or steps it takes, any more and the complexity is
+// left unknown.
+#define RX_ANALYZE_MAX_NODES 128
+#define RX_ANALYZE_MAX_EDGES (1 << 20)
+#define RX_ANALYZE_MAX_STEPS (1 << 24)
+
+// A way from a consuming node, or a pair of them, to the next. paths is how
+// many different ways through the nodes in between there are, up to 2. end is
+// the first atomic group end on the way, -1 if there's none, or -2 if the
+// ways go through different ones. lo and hi are where in the regexp the nodes
+// on the way are from.
+typedef struct {
+    int to;
+    int paths;
+    int end;
+    int lo;
+    int hi;
+} analyze_edge_t;
+
+static void rx_analyze_edge_add (analyze_edge_t **edges, int *count, int *allocated, int to, int paths, int end, int lo, int hi) {
+    if (*count == *allocated) {
+        *allocated = *allocated ? 2 * *allocated : 64;
+        *edges = realloc(*edges, *allocated * sizeof(analyze_edge_t));
+    }
+    analyze_edge_t *e = *edges + *count;
+    e->to = to;
+    e->paths = paths;
+    e->end = end;
+    e->lo = lo;
+    e->hi = hi;
+    *count += 1;
+}
+
+// Returns where the part of the regexp that starts at pos ends.
+static int rx_token_end (rx_t *rx, int pos) {
+    char *regexp = rx->regexp;
+    int size = rx->regexp_size;
+    if (pos >= size) {
+        return size;
+    }
+    char c = regexp[pos];
+    int end = pos + rx_utf8_char_size(size, regexp, pos);
+    if (c == '\\' && pos + 1 < size) {
+        char c2 = regexp[pos + 1];
+        end = pos + 2 + (c2 == 'x' ? 2 : c2 == 'u' ? 4 : c2 == 'U' ? 8 : 0);
+    } else if (c == '[') {
+        for (int i = 0; i < rx->char_classes_count; i += 1) {
+            if (rx->char_classes[i]->str == regexp + pos) {
+                end = pos + rx->char_classes[i]->str_size;
+            }
+        }
+    } else if (c == '{') {
+        char *p = memchr(regexp + pos, '}', size - pos);
+        end = p ? p - regexp + 1 : size;
+    }
+    if ((c == '*' || c == '+' || c == '?' || c == '{' || c == '}') && end < size && (regexp[end] == '?' || regexp[end] == '+')) {
+        // lazy or possessive
+        end += 1;
+    }
+    return end < size ? end : size;
+}
+
+// Sets what rx_analyze() found, with a message saying which part of the
+// regexp it's because of, from lo to the end of what's at hi.
+// Widens the part of the regexp from lo up to end so it doesn't cut through a
+// group, taking in the brackets of every group it has only one of, and the
+// quantifier after the ) of one it takes in that way.
+static void rx_complexity_widen (rx_t *rx, int *lo, int *end) {
+    int size = rx->regexp_size;
+    int *opens = malloc((size + 1) * sizeof(int));
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        int depth = 0;
+        for (int pos = 0; pos < size; pos = rx_token_end(rx, pos)) {
+            char c = rx->regexp[pos];
+            if (c == '(') {
+                opens[depth] = pos;
+                depth += 1;
+            } else if (c == ')' && depth) {
+                depth -= 1;
+                int open = opens[depth];
+                int inside_open = open >= *lo && open < *end;
+                int inside_close = pos >= *lo && pos < *end;
+                if (inside_open == inside_close) {
+                    continue;
+                }
+                if (inside_close) {
+                    *lo = open;
+                }
+                int end2 = pos + 1;
+                if (end2 < size && strchr("*+?{", rx->regexp[end2])) {
+                    end2 = rx_token_end(rx, end2);
+                }
+                if (end2 > *end) {
+                    *end = end2;
+                }
+                changed = 1;
+            }
+        }
+    }
+    free(opens);
+}
+
+static void rx_complexity (rx_t *rx, int complexity, int degree, int lo, int hi) {
+    rx->complexity = complexity;
+    rx->complexity_degree = degree;
+    free(rx->complexitystr);
+    rx->complexitystr = NULL;
+    if (complexity == COMPLEXITY_UNKNOWN) {
+        rx->complexitystr = malloc(64);
+        snprintf(rx->complexitystr, 64, "Too big to analyze.");
+        return;
+    }
+    if (complexity == COMPLEXITY_LINEAR) {
+        return;
+    }
+    if (lo > hi) {
+        lo = 0;
+        hi = rx->regexp_size;
+    }
+    int end = rx_token_end(rx, hi);
+    rx_complexity_widen(rx, &lo, &end);
+    rx->complexity_pos = lo;
+    rx->complexity_size = end - lo;
+    int size = rx->complexity_size + 64;
+    rx->complexitystr = malloc(size);
+    if (complexity == COMPLEXITY_EXPONENTIAL) {
+        snprintf(rx->complexitystr, size, "Exponential because of %.*s.", rx->complexity_size, rx->regexp + lo);
+    } else {
+        snprintf(rx->complexitystr, size, "Polynomial of degree %d because of %.*s.", degree, rx->complexity_size, rx->regexp + lo);
+    }
+}
+
+// The backtracker is slow when there's more than one way through the regexp
+// for the same string, which it tries one after the other. This looks for that
+// on the consuming nodes, with the ways between them through the nodes that
+// don't consume anything. Two ways at once are a pair of consuming nodes, which
+// go to the pairs of nodes after them that can take the same byte. If a node
+// can loop back to itself two different ways, either through a pair that isn't
+// the same node twice or two ways between the same nodes, each time around the
+// loop doubles what the backtracker tries, so it's exponential. If a loop can
+// go to another loop, taking the same strings on the way that either could
+// take by itself, the two split up whatever they both take every way there is,
+// which is polynomial, of the degree of how many loops like that there are one
+// after the other.
+//
+// It leaves out the ways the backtracker never gets to try. A node that can
+// get to the match end without anything that could fail on the way never fails
+// back from there, and a node in an atomic group that can get to the end of the
+// group like that doesn't either, as far as the other nodes in the group go.
+// Nothing goes back to it from after the group, so it doesn't give back what
+// its loop took. Two ways out of the same atomic group end up as one.
+//
+// A span is gone through by its next, like the loop it is. Its next2 is the
+// way past the run the backtracker takes all at once.
+static void rx_analyze (rx_t *rx) {
+    int nodes_count = rx->nodes_count;
+    int *id = malloc(nodes_count * sizeof(int));
+    int *cons = malloc(nodes_count * sizeof(int));
+    int n = 0;
+    for (int i = 0; i < nodes_count; i += 1) {
+        id[i] = -1;
+        if (rx_node_consumes(rx->nodes[i])) {
+            id[i] = n;
+            cons[n] = i;
+            n += 1;
+        }
+    }
+    if (n > RX_ANALYZE_MAX_NODES) {
+        free(id);
+        free(cons);
+        rx_complexity(rx, COMPLEXITY_UNKNOWN, 0, 0, 0);
+        return;
+    }
+
+    // Which consuming nodes each atomic group has, and which end is whose.
+    // The depth is how many atomic groups in it is, as in rx_memo_layout_init().
+    int groups = 0;
+    for (int i = 0; i < nodes_count; i += 1) {
+        groups += rx->nodes[i]->type == ATOMIC_START;
+    }
+    unsigned char *member = calloc(groups * n + 1, 1);
+    int *group_of_end = malloc(nodes_count * sizeof(int));
+    int *visited = calloc(nodes_count, sizeof(int));
+    int *stack = malloc(4 * (4 * nodes_count + 2) * sizeof(int));
+    for (int i = 0; i < nodes_count; i += 1) {
+        group_of_end[i] = -1;
+    }
+    int g = 0;
+    for (int i = 0; i < nodes_count; i += 1) {
+        node_t *node = rx->nodes[i];
+        if (node->type != ATOMIC_START) {
+            continue;
+        }
+        int stack_count = 1;
+        stack[0] = node->next->index;
+        stack[1] = 1;
+        while (stack_count) {
+            stack_count -= 1;
+            node_t *node2 = rx->nodes[stack[2 * stack_count]];
+            int depth = stack[2 * stack_count + 1];
+            if (visited[node2->index] == g + 1) {
+                continue;
+            }
+            visited[node2->index] = g + 1;
+            if (id[node2->index] >= 0) {
+                member[g * n + id[node2->index]] = 1;
+            }
+            if (node2->type == ATOMIC_START) {
+                depth += 1;
+            } else if (node2->type == ATOMIC_END) {
+                depth -= 1;
+            }
+            if (depth == 0) {
+                group_of_end[node2->index] = g;
+                continue;
+            }
+            if (node2->type == MATCH_END) {
+                continue;
+            }
+            stack[2 * stack_count] = node2->next->index;
+            stack[2 * stack_count + 1] = depth;
+            stack_count += 1;
+            if (node2->type == BRANCH) {
+                stack[2 * stack_count] = node2->next2->index;
+                stack[2 * stack_count + 1] = depth;
+                stack_count += 1;
+            }
+        }
+        g += 1;
+    }
+
+    // The pairs that can't be two ways the backtracker tries, from the nodes
+    // that get to the match end or the end of their atomic group without
+    // anything on the way that could fail. commits has the ones in an atomic
+    // group.
+    unsigned char *kill = calloc(n * n + 1, 1);
+    unsigned char *commits = calloc(n + 1, 1);
+    memset(visited, 0, nodes_count * sizeof(int));
+    for (int u = 0; u < n; u += 1) {
+        int stack_count = 1;
+        stack[0] = rx->nodes[cons[u]]->next->index;
+        while (stack_count) {
+            stack_count -= 1;
+            node_t *node = rx->nodes[stack[stack_count]];
+            if (visited[node->index] == u + 1) {
+                continue;
+            }
+            visited[node->index] = u + 1;
+            if (rx_node_consumes(node) || node->type == ASSERTION || node->type == COUNT_START || node->type == COUNT) {
+                continue;
+            }
+            if (node->type == MATCH_END) {
+                for (int v = 0; v < n; v += 1) {
+                    kill[u * n + v] = kill[v * n + u] = 1;
+                }
+                continue;
+            }
+            g = group_of_end[node->index];
+            if (g >= 0 && member[g * n + u]) {
+                commits[u] = 1;
+                for (int v = 0; v < n; v += 1) {
+                    if (member[g * n + v]) {
+                        kill[u * n + v] = kill[v * n + u] = 1;
+                    }
+                }
+            }
+            stack[stack_count] = node->next->index;
+            stack_count += 1;
+            if (node->type == BRANCH) {
+                stack[stack_count] = node->next2->index;
+                stack_count += 1;
+            }
+        }
+    }
+
+    // The ways from each consuming node to the next ones. Each node on the way
+    // is gone on from for the first two ways to it, which is enough to tell
+    // if there's more than one way to what comes after it. An atomic group end
+    // is only gone on from for the first, since everything else that went
+    // through the group is dropped there.
+    analyze_edge_t *edges = NULL;
+    int edges_count = 0;
+    int edges_allocated = 0;
+    int *edges_start = malloc((n + 1) * sizeof(int));
+    int *arrived = calloc(nodes_count, sizeof(int));
+    int *edge_of = malloc(nodes_count * sizeof(int));
+    memset(visited, 0, nodes_count * sizeof(int));
+    for (int u = 0; u < n; u += 1) {
+        node_t *node = rx->nodes[cons[u]];
+        edges_start[u] = edges_count;
+        int stack_count = 1;
+        stack[0] = node->next->index;
+        stack[1] = -1;
+        stack[2] = node->pos;
+        stack[3] = node->pos;
+        while (stack_count) {
+            stack_count -= 1;
+            int *s = stack + 4 * stack_count;
+            node_t *node2 = rx->nodes[s[0]];
+            int end = s[1];
+            int lo = node2->pos < s[2] ? node2->pos : s[2];
+            int hi = node2->pos > s[3] ? node2->pos : s[3];
+            if (visited[node2->index] != u + 1) {
+                visited[node2->index] = u + 1;
+                arrived[node2->index] = 0;
+            }
+            arrived[node2->index] += 1;
+            if (id[node2->index] >= 0) {
+                if (arrived[node2->index] == 1) {
+                    edge_of[node2->index] = edges_count;
+                    rx_analyze_edge_add(&edges, &edges_count, &edges_allocated, id[node2->index], 1, end, lo, hi);
+                } else {
+                    analyze_edge_t *e = edges + edge_of[node2->index];
+                    e->paths = 2;
+                    e->end = e->end == end ? end : -2;
+                    e->lo = lo < e->lo ? lo : e->lo;
+                    e->hi = hi > e->hi ? hi : e->hi;
+                }
+                continue;
+            }
+            if (arrived[node2->index] > 2 || node2->type == MATCH_END ||
+                (node2->type == ATOMIC_END && arrived[node2->index] > 1)) {
+                continue;
+            }
+            if (node2->type == ATOMIC_END && end == -1) {
+                end = node2->index;
+            }
+            node_t *nexts[2] = {node2->next, node2->type == BRANCH ? node2->next2 : NULL};
+            for (int j = 0; j < 2; j += 1) {
+                if (nexts[j]) {
+                    s = stack + 4 * stack_count;
+                    s[0] = nexts[j]->index;
+                    s[1] = end;
+                    s[2] = lo;
+                    s[3] = hi;
+                    stack_count += 1;
+                }
+            }
+        }
+    }
+    edges_start[n] = edges_count;
+
+    // Which pairs of nodes can take the same byte.
+    unsigned char *bytes = malloc(256 * n + 1);
+    unsigned char *overlap = calloc(n * n + 1, 1);
+    for (int u = 0; u < n; u += 1) {
+        rx_node_bytes(rx->nodes[cons[u]], bytes + 256 * u);
+    }
+    for (int u = 0; u < n; u += 1) {
+        for (int v = u; v < n; v += 1) {
+            int c;
+            for (c = 0; c < 256 && !(bytes[256 * u + c] && bytes[256 * v + c]); c += 1) {
+            }
+            overlap[u * n + v] = overlap[v * n + u] = c < 256;
+        }
+    }
+
+    // The ways from each pair of nodes to the next pairs. One that's two ways
+    // between the same nodes has 2 paths.
+    int pairs = n * n;
+    analyze_edge_t *pedges = NULL;
+    int pedges_count = 0;
+    int pedges_allocated = 0;
+    int *pedges_start = malloc((pairs + 1) * sizeof(int));
+    int too_big = 0;
+    for (int p = 0; p < pairs && !too_big; p += 1) {
+        int u = p / n, v = p % n;
+        pedges_start[p] = pedges_count;
+        if (kill[p]) {
+            continue;
+        }
+        for (int i = edges_start[u]; i < edges_start[u + 1]; i += 1) {
+            for (int j = edges_start[v]; j < edges_start[v + 1]; j += 1) {
+                analyze_edge_t *e1 = edges + i, *e2 = edges + j;
+                int a = e1->to, b = e2->to;
+                int lo = e1->lo < e2->lo ? e1->lo : e2->lo;
+                int hi = e1->hi > e2->hi ? e1->hi : e2->hi;
+                if (!overlap[a * n + b]) {
+                    continue;
+                }
+                if (e1->end >= 0 && e1->end == e2->end) {
+                    // Both leave the same atomic group, which only one of them does.
+                    if (!kill[a * n + a]) {
+                        rx_analyze_edge_add(&pedges, &pedges_count, &pedges_allocated, a * n + a, 1, -1, lo, hi);
+                    }
+                    if (a != b && !kill[b * n + b]) {
+                        rx_analyze_edge_add(&pedges, &pedges_count, &pedges_allocated, b * n + b, 1, -1, lo, hi);
+                    }
+                } else if (!kill[a * n + b]) {
+                    int paths = u == v && i == j ? e1->paths : 1;
+                    rx_analyze_edge_add(&pedges, &pedges_count, &pedges_allocated, a * n + b, paths, -1, lo, hi);
+                }
+            }
+        }
+        too_big = pedges_count > RX_ANALYZE_MAX_EDGES;
+    }
+    pedges_start[pairs] = pedges_count;
+
+    // And from each pair back to the ones before it.
+    int *rstart = calloc(pairs + 2, sizeof(int));
+    int *redges = malloc((pedges_count + 1) * sizeof(int));
+    for (int i = 0; i < pedges_count && !too_big; i += 1) {
+        rstart[pedges[i].to + 2] += 1;
+    }
+    for (int p = 0; p < pairs && !too_big; p += 1) {
+        rstart[p + 2] += rstart[p + 1];
+    }
+    for (int p = 0; p < pairs && !too_big; p += 1) {
+        for (int i = pedges_start[p]; i < pedges_start[p + 1]; i += 1) {
+            redges[rstart[pedges[i].to + 1]] = p;
+            rstart[pedges[i].to + 1] += 1;
+        }
+    }
+
+    // The pairs each node's pair (x, x) goes to, and the ones that go to it.
+    int words = (pairs + 63) / 64;
+    unsigned long long *fwd = calloc((long) n * words + 1, sizeof(unsigned long long));
+    unsigned long long *back = calloc((long) n * words + 1, sizeof(unsigned long long));
+    unsigned char *looping = calloc(n + 1, 1);
+    int *queue = malloc((pairs + 1) * sizeof(int));
+    long steps = 0;
+    for (int x = 0; x < n && !too_big; x += 1) {
+        int xx = x * n + x;
+        if (kill[xx]) {
+            continue;
+        }
+        for (int dir = 0; dir < 2; dir += 1) {
+            unsigned long long *set = (dir ? back : fwd) + (long) x * words;
+            int head = 0, tail = 1;
+            queue[0] = xx;
+            set[xx >> 6] |= 1ULL << (xx & 63);
+            while (head < tail) {
+                int p = queue[head];
+                head += 1;
+                int start = dir ? rstart[p] : pedges_start[p];
+                int end = dir ? rstart[p + 1] : pedges_start[p + 1];
+                steps += end - start;
+                for (int i = start; i < end; i += 1) {
+                    int q = dir ? redges[i] : pedges[i].to;
+                    if (!(set[q >> 6] & (1ULL << (q & 63)))) {
+                        set[q >> 6] |= 1ULL << (q & 63);
+                        queue[tail] = q;
+                        tail += 1;
+                    }
+                }
+            }
+        }
+        unsigned long long *f = fwd + (long) x * words;
+        for (int i = rstart[xx]; i < rstart[xx + 1]; i += 1) {
+            if (f[redges[i] >> 6] & (1ULL << (redges[i] & 63))) {
+                looping[x] = 1;
+            }
+        }
+        too_big = steps > RX_ANALYZE_MAX_STEPS;
+    }
+
+    #define RX_IN(set, p) ((set)[(p) >> 6] & (1ULL << ((p) & 63)))
+    int complexity = COMPLEXITY_LINEAR, degree = 1, lo = rx->regexp_size, hi = 0;
+    for (int x = 0; x < n && !too_big && complexity == COMPLEXITY_LINEAR; x += 1) {
+        if (!looping[x]) {
+            continue;
+        }
+        // The ways around the loop are the ways from a pair it goes to, to
+        // a pair that goes back to it.
+        unsigned long long *f = fwd + (long) x * words, *b = back + (long) x * words;
+        int ambiguous = 0;
+        int lo2 = rx->regexp_size, hi2 = 0;
+        for (int p = 0; p < pairs; p += 1) {
+            if (!RX_IN(f, p)) {
+                continue;
+            }
+            for (int i = pedges_start[p]; i < pedges_start[p + 1]; i += 1) {
+                analyze_edge_t *e = pedges + i;
+                if (RX_IN(b, e->to)) {
+                    ambiguous |= e->to / n != e->to % n || e->paths > 1;
+                    lo2 = e->lo < lo2 ? e->lo : lo2;
+                    hi2 = e->hi > hi2 ? e->hi : hi2;
+                }
+            }
+        }
+        if (ambiguous) {
+            complexity = COMPLEXITY_EXPONENTIAL;
+            degree = 0;
+            lo = lo2;
+            hi = hi2;
+        }
+    }
+
+    if (!too_big && complexity == COMPLEXITY_LINEAR) {
+        // A loop comes before another when the pair of them is on the way
+        // from the first one's pair to the other one's. The degree is the
+        // most loops there are one before the other.
+        int *chain = malloc((n + 1) * sizeof(int));
+        int *after = malloc((n + 1) * sizeof(int));
+        for (int p = 0; p < n; p += 1) {
+            chain[p] = looping[p];
+            after[p] = -1;
+        }
+        int changed = 1;
+        for (int round = 0; round < n && changed; round += 1) {
+            changed = 0;
+            for (int p = 0; p < n; p += 1) {
+                if (!looping[p] || commits[p]) {
+                    continue;
+                }
+                for (int q = 0; q < n; q += 1) {
+                    int pq = p * n + q;
+                    if (q != p && looping[q] && chain[q] + 1 > chain[p] && chain[q] < n &&
+                        RX_IN(fwd + (long) p * words, pq) && RX_IN(back + (long) q * words, pq)) {
+                        chain[p] = chain[q] + 1;
+                        after[p] = q;
+                        changed = 1;
+                    }
+                }
+            }
+        }
+        int first = 0;
+        for (int p = 0; p < n; p += 1) {
+            if (chain[p] > chain[first]) {
+                first = p;
+            }
+        }
+        if (n && chain[first] >= 2) {
+            complexity = COMPLEXITY_POLYNOMIAL;
+            degree = chain[first];
+            int p = first;
+            for (int k = 1; k < degree; k += 1) {
+                int q = after[p];
+                unsigned long long *f = fwd + (long) p * words, *b = back + (long) q * words;
+                for (int s = 0; s < pairs; s += 1) {
+                    if (!RX_IN(f, s)) {
+                        continue;
+                    }
+                    for (int i = pedges_start[s]; i < pedges_start[s + 1]; i += 1) {
+                        analyze_edge_t *e = pedges + i;
+                        if (RX_IN(b, e->to)) {
+                            lo = e->lo < lo ? e->lo : lo;
+                            hi = e->hi > hi ? e->hi : hi;
+                        }
+                    }
+                }
+                p = q;
+            }
+        }
+        free(chain);
+        free(after);
+    }
+    #undef RX_IN
+
+    if (too_big) {
+        rx_complexity(rx, COMPLEXITY_UNKNOWN, 0, 0, 0);
+    } else {
+        rx_complexity(rx, complexity, degree, lo, hi);
+    }
+    free(id);
+    free(cons);
+    free(member);
+    free(group_of_end);
+    free(visited);
+    free(stack);
+    free(kill);
+    free(commits);
+    free(edges);
+    free(edges_start);
+    free(arrived);
+    free(edge_of);
+    free(bytes);
+    free(overlap);
+    free(pedges);
+    free(pedges_start);
+    free(rstart);
+    free(redges);
+    free(fwd);
+    free(back);
+    free(looping);
+    free(queue);
+}
+
+// The most memory the memoized backtracker can use, in bytes
+#define RX_MEMO_MAX_SIZE (1 << 22)
+
+// The memoized backtracker goes by having failed from a branch at a position
+// meaning it always will. That isn't so for the branches in an atomic group,
+// which is left before everything from them has been tried, so nomemo is set
+// for those, which it doesn't remember. In a counted loop, where the way out
+// depends on the counter, it remembers a branch for each count, in rows of the
+// memo of its own, after the one row for each node. Counts past the minimum of
+// a loop without a maximum all go the same way, so they share a row. A branch
+// in more than one counted loop isn't remembered, and the rows for counts are
+// only used when the memo for the string has room for them.
+struct memo_layout_t {
+    unsigned char *nomemo;
+    int *counter; // the counted loop a node is in, or -1
+    int *row;     // the row for count 0 of a branch in a counted loop
+    int rows;
+};
+
+static void rx_memo_layout_free (memo_layout_t *ml) {
+    if (!ml) {
+        return;
+    }
+    free(ml->nomemo);
+    free(ml->counter);
+    free(ml->row);
+    free(ml);
+}
+
+static void rx_memo_layout_init (rx_t *rx) {
+    memo_layout_t *ml = calloc(1, sizeof(memo_layout_t));
+    ml->nomemo = calloc(rx->nodes_count, 1);
+    ml->counter = malloc(rx->nodes_count * sizeof(int));
+    ml->row = malloc(rx->nodes_count * sizeof(int));
+    int *visited = calloc(rx->nodes_count, sizeof(int));
+    int *stack = malloc(2 * (2 * rx->nodes_count + 1) * sizeof(int));
+    for (int i = 0; i < rx->nodes_count; i += 1) {
+        ml->counter[i] = -1;
+        ml->row[i] = -1;
+    }
+    for (int i = 0; i < rx->nodes_count; i += 1) {
+        node_t *node = rx->nodes[i];
+        node_t *exit = NULL;
+        if (node->type == COUNT_START) {
+            node_t *branch = node->next->next;
+            exit = rx->counters[node->value].greedy ? branch->next2 : branch->next;
+        } else if (node->type != ATOMIC_START) {
+            continue;
+        }
+        // The depth is how many atomic groups in it is, the end of the
+        // group that's at depth 0 is the end of this one.
+        int stack_count = 1;
+        stack[0] = node->next->index;
+        stack[1] = 1;
+        while (stack_count) {
+            stack_count -= 1;
+            node_t *node2 = rx->nodes[stack[2 * stack_count]];
+            int depth = stack[2 * stack_count + 1];
+            if (node2 == exit || visited[node2->index] == i + 1) {
+                continue;
+            }
+            visited[node2->index] = i + 1;
+            if (node->type == ATOMIC_START || ml->counter[node2->index] >= 0) {
+                ml->nomemo[node2->index] = 1;
+            } else {
+                ml->counter[node2->index] = node->value;
+            }
+            if (node2->type == ATOMIC_START) {
+                depth += 1;
+            } else if (node2->type == ATOMIC_END) {
+                depth -= 1;
+            }
+            if (depth == 0 || node2->type == MATCH_END) {
+                continue;
+            }
+            stack[2 * stack_count] = node2->next->index;
+            stack[2 * stack_count + 1] = depth;
+            stack_count += 1;
+            if (node2->type == BRANCH || node2->type == SPAN || node2->type == SPAN_LAZY) {
+                stack[2 * stack_count] = node2->next2->index;
+                stack[2 * stack_count + 1] = depth;
+                stack_count += 1;
+            }
+        }
+    }
+    long rows = rx->nodes_count;
+    for (int i = 0; i < rx->nodes_count; i += 1) {
+        if (ml->nomemo[i] || ml->counter[i] < 0 || rx->nodes[i]->type != BRANCH) {
+            continue;
+        }
+        quantifier_t *qval = rx->counters + ml->counter[i];
+        long count_rows = qval->max == -1 ? qval->min + 1 : qval->max;
+        if (rows + count_rows > (long) RX_MEMO_MAX_SIZE * 8) {
+            ml->nomemo[i] = 1;
+            continue;
+        }
+        ml->row[i] = rows;
+        rows += count_rows;
+    }
+    ml->rows = rows;
+    free(visited);
+    free(stack);
+    rx->internal->memo_layout = ml;
+}
+
+// Returns the size of the memo in bytes for memo_width positions, with the rows
+// for counts if counted is set.
+static long rx_memo_size (rx_t *rx, int counted, int memo_width) {
+    long rows = counted ? rx->internal->memo_layout->rows : rx->nodes_count;
+    return (rows * memo_width + 7) / 8;
+}
+
+// Returns the row of the memo for a branch with the counters as they are, or -1
+// if it isn't remembered. counted says if the memo has the rows for counts.
+static int rx_memo_row (rx_t *rx, matcher_t *m, node_t *node, int counted) {
+    memo_layout_t *ml = rx->internal->memo_layout;
+    if (ml->nomemo[node->index]) {
+        return -1;
+    }
+    int c = ml->counter[node->index];
+    if (c < 0) {
+        return node->index;
+    }
+    if (!counted) {
+        return -1;
+    }
+    quantifier_t *qval = rx->counters + c;
+    int count = m->internal->counters[c];
+    if (qval->max == -1 && count > qval->min) {
+        count = qval->min;
+    }
+    return ml->row[node->index] + count;
+}
+
+// Returns the nodes the backtracker can go to from node without taking anything,
+// in next, and how many there are.
+static int rx_empty_next (node_t *node, node_t **next) {
+    if (rx_node_consumes(node) || node->type == MATCH_END) {
+        return 0;
+    }
+    if (node->type == SPAN || node->type == SPAN_LAZY) {
+        // The backtracker goes around the loop of a span all at once, so it
+        // only goes on without taking anything for X*, not for X+.
+        if (node->next->type != BRANCH) {
+            return 0;
+        }
+        next[0] = node->next2;
+        return 1;
+    }
+    next[0] = node->next;
+    if (node->type == BRANCH) {
+        next[1] = node->next2;
+        return 2;
+    }
+    return 1;
+}
+
+// A loop whose body can match nothing, like (a|)* or (b*)+, can go around
+// forever without taking anything. Each of those goes through a branch or a
+// span that's in a cycle of nodes that don't consume, which this finds with
+// Tarjan's strongly connected components and sets in rx->internal->empty_loops. The
+// backtracker fails when it comes back to one of those at a position it
+// already went through it at, so an iteration that takes nothing ends the
+// loop. That's the same as the other engines, which follow the nodes as sets
+// of states and drop a state that's already in the set.
+static void rx_empty_loops_init (rx_t *rx) {
+    int n = rx->nodes_count;
+    int *order = malloc(n * sizeof(int));
+    int *low = malloc(n * sizeof(int));
+    int *edge = malloc(n * sizeof(int));
+    int *calls = malloc(n * sizeof(int));
+    int *stack = malloc(n * sizeof(int));
+    unsigned char *on_stack = calloc(n, 1);
+    unsigned char *loops = calloc(n, 1);
+    int found = 0;
+    int count = 0;
+    for (int i = 0; i < n; i += 1) {
+        order[i] = -1;
+    }
+    for (int root = 0; root < n; root += 1) {
+        if (order[root] >= 0) {
+            continue;
+        }
+        int calls_count = 0;
+        int stack_count = 0;
+        calls[calls_count++] = root;
+        order[root] = low[root] = count++;
+        edge[root] = 0;
+        stack[stack_count++] = root;
+        on_stack[root] = 1;
+        while (calls_count) {
+            int u = calls[calls_count - 1];
+            node_t *next[2];
+            int next_count = rx_empty_next(rx->nodes[u], next);
+            if (edge[u] < next_count) {
+                int v = next[edge[u]]->index;
+                edge[u] += 1;
+                if (v == u) {
+                    loops[u] = 1;
+                } else if (order[v] < 0) {
+                    order[v] = low[v] = count++;
+                    edge[v] = 0;
+                    stack[stack_count++] = v;
+                    on_stack[v] = 1;
+                    calls[calls_count++] = v;
+                } else if (on_stack[v] && order[v] < low[u]) {
+                    low[u] = order[v];
+                }
+                continue;
+            }
+            calls_count -= 1;
+            if (calls_count && low[u] < low[calls[calls_count - 1]]) {
+                low[calls[calls_count - 1]] = low[u];
+            }
+            if (low[u] != order[u]) {
+                continue;
+            }
+            // u is the root of a component, which is a cycle if it has more
+            // than u in it.
+            int cycle = stack[stack_count - 1] != u;
+            int v;
+            do {
+                v = stack[--stack_count];
+                on_stack[v] = 0;
+                loops[v] |= cycle;
+            } while (v != u);
+        }
+    }
+    for (int i = 0; i < n; i += 1) {
+        int type = rx->nodes[i]->type;
+        if (loops[i] && (type == BRANCH || type == SPAN || type == SPAN_LAZY)) {
+            found = 1;
+        } else {
+            loops[i] = 0;
+        }
+    }
+    if (found) {
+        rx->internal->empty_loops = loops;
+    } else {
+        free(loops);
+    }
+    free(order);
+    free(low);
+    free(edge);
+    free(calls);
+    free(stack);
+    free(on_stack);
+}
+
+// Builds the things rx_match() uses to avoid running the backtracker when it
+// doesn't need to.
+static void rx_prepare (rx_t *rx) {
+    rx_optimize(rx);
+    rx_empty_loops_init(rx);
+    rx_memo_layout_init(rx);
+    if (rx->analyze) {
+        rx_analyze(rx);
+    }
+    rx_find_prefix(rx);
+    if (!rx->internal->prefix_size) {
+        rx_literals_init(rx);
+    }
+    if (!rx->internal->prefix_size && !rx->internal->literals) {
+        rx_glushkov_init(rx);
+    }
+    rx_onepass_init(rx);
+    if (rx->internal->onepass && !rx->internal->onepass->anchored) {
+        rx_onepass_free(rx->internal->onepass);
+        rx->internal->onepass = NULL;
+    }
+    if (!rx->internal->onepass) {
+        rx_tdfa_init(rx);
+        rx_reverse_init(rx);
+    }
+    rx_runs_init(rx);
+    rx_dispatch_init(rx);
+    rx_scans_init(rx);
+    rx_plan(rx);
+}
+
+// Returns the first position at or after pos where the literal occurs, or -1.
+// When fold is given, the bytes of the string are or'd with it before comparing,
+// which is how letters that ignore case are compared.
+static int rx_find_literal (int str_size, char *str, int pos, int lit_size, char *lit, char *fold) {
+    if (fold) {
+        for (; pos + lit_size <= str_size; pos += 1) {
+            int i;
+            for (i = 0; i < lit_size; i += 1) {
+                if ((str[pos + i] | fold[i]) != lit[i]) {
+                    break;
+                }
+            }
+            if (i == lit_size) {
+                return pos;
+            }
+        }
+        return -1;
+    }
+    while (pos + lit_size <= str_size) {
+        char *p = memchr(str + pos, lit[0], str_size - lit_size + 1 - pos);
+        if (!p) {
+            break;
+        }
+        pos = p - str;
+        if (memcmp(p + 1, lit + 1, lit_size - 1) == 0) {
+            return pos;
+        }
+        pos += 1;
+    }
+    return -1;
+}
+
+// Leaving an atomic group drops the ways to backtrack into it from the path,
+// along with the entry for where the group started, but keeps the captures and
+// the counters to put back.
+static void rx_path_atomic (matcher_t *m) {
+    int i;
+    for (i = m->path_count - 1; i >= 0; i -= 1) {
+        if (m->path[i].node->type == ATOMIC_START) {
+            break;
+        }
+    }
+    if (i < 0) {
+        return;
+    }
+    int count = i;
+    for (i += 1; i < m->path_count; i += 1) {
+        node_t *node = m->path[i].node;
+        if (node->type == CAPTURE_START || node->type == CAPTURE_END ||
+            node->type == COUNT_START || node->type == COUNT) {
+            m->path[count] = m->path[i];
+            count += 1;
+        }
+    }
+    m->path_count = count;
+}
+
+// Returns 1 if the backtracker already went through node at pos on its way
+// here, going around a loop without taking anything. The entries in the path
+// from pos are the ones to look through. The times around a counted loop are
+// each different while it's under its minimum count, or when it has a maximum,
+// the same as if it was written out that many times, so going through node in
+// an earlier one of those doesn't count.
+static int rx_empty_loop (rx_t *rx, matcher_t *m, node_t *node, int pos) {
+    int i = m->path_count - 1;
+    while (i >= 0 && m->path[i].pos == pos) {
+        path_t *p = m->path + i;
+        if (p->node == node) {
+            return 1;
+        }
+        quantifier_t *qval = p->node->type == COUNT ? rx->counters + p->node->value : NULL;
+        if (qval && (qval->max != -1 || p->pos2 + 1 < qval->min)) {
+            for (i -= 1; i >= 0; i -= 1) {
+                path_t *p2 = m->path + i;
+                if (p2->node == node) {
+                    return 0;
+                }
+                if (p2->node->type == COUNT_START && p2->node->value == p->node->value) {
+                    break;
+                }
+            }
+        }
+        i -= 1;
+    }
+    return 0;
+}
+
+// A span stands for a greedy loop over a single character, X* or X+. Its next is
+// the loop, which is what the other engines go through, and its next2 is what
+// comes after the loop. The backtracker takes the whole run of X at once, with
+// a single entry in the path for the span that has where the run can end from
+// pos to pos2, instead of an entry for each character.
+//
+// A lazy span is the same for X*? and X+?. Its entry in the path has where the
+// run ends now, which only moves forward when what comes after doesn't match.
+static node_t *rx_span_body (node_t *node) {
+    if (node->next->type != BRANCH) {
+        return node->next;
+    }
+    return node->type == SPAN ? node->next->next : node->next->next2;
+}
+
+// Returns where the run of characters the node matches from pos ends, not
+// going on from limit or after.
+static int rx_span (rx_t *rx, matcher_t *m, node_t *node, int str_size, char *str, int pos, int limit) {
+    int size = limit < str_size ? limit : str_size;
+    if (rx->internal->scans && node->type != CHAR_CLASS && !(node->type == CHAR_SET && (node->value == CS_ANY || node->value == CS_NOTNL))) {
+        pos = pos < size ? rx_scan(&rx->internal->scans->sets[node->index], str, pos, size, 0) : pos;
+    } else if (node->type == TAKE) {
+        while (pos < size && (unsigned char) str[pos] == node->value) {
+            pos += 1;
+        }
+    } else if (node->type == TAKE_NOCASE) {
+        while (pos < size && ((unsigned char) str[pos] | 0x20) == node->value) {
+            pos += 1;
+        }
+    } else if (node->type == CHAR_SET && node->value == CS_ANY) {
+        pos = pos < size ? size : pos;
+    } else if (node->type == CHAR_SET && node->value == CS_NOTNL) {
+        char *p = pos < size ? memchr(str + pos, '\n', size - pos) : NULL;
+        pos = p ? p - str : pos < size ? size : pos;
+    } else if (node->type == CHAR_SET) {
+        while (pos < size && rx_match_char_set(node->value, str[pos])) {
+            pos += 1;
+        }
+    } else {
+        char_class_t *ccval = node->ccval;
+        while (pos < size) {
+            unsigned char c = str[pos];
+            if (c < 0x80) {
+                // An ascii character is just its bit.
+                if (!(ccval->bytes[c >> 3] & (1 << (c & 7)))) {
+                    break;
+                }
+                pos = rx->internal->scans ? rx_scan(&rx->internal->scans->sets[node->index], str, pos + 1, size, 0) : pos + 1;
+                continue;
+            }
+            int test_size = rx_utf8_char_size(str_size, str, pos);
+            if (test_size == 1 && (str[pos] & 0xc0) == 0xc0 && str_size - pos < 4) {
+                // A utf8 character that might have been cut off by the end of the string
+                m->hit_end = 1;
+            }
+            if (!rx_match_char_class(rx, ccval, test_size, str + pos)) {
+                break;
+            }
+            pos += test_size;
+        }
+    }
+    if (pos >= str_size && pos < limit) {
+        m->hit_end = 1;
+    }
+    return pos;
+}
+
+// Returns the byte that has to come next after a span, 256 if it has to be the
+// start of a line, or -1 if it could be anything else.
+static int rx_span_follow (node_t *node) {
+    while (node->type == EMPTY || node->type == GROUP_START || node->type == GROUP_END ||
+           node->type == CAPTURE_START || node->type == CAPTURE_END) {
+        node = node->next;
+    }
+    if (node->type == ASSERTION && node->value == ASSERT_SOL) {
+        return 256;
+    }
+    return node->type == TAKE ? (unsigned char) node->value : -1;
+}
+
+// Returns where the run of a span ends when it gives back the last character
+// before end, or a position before min if it can't.
+static int rx_span_back (node_t *node, int str_size, char *str, int min, int end) {
+    node_t *body = rx_span_body(node);
+    if (body->type == CHAR_CLASS) {
+        // The character before end is the longest one that rx_utf8_char_size()
+        // would have taken, anything else is a single byte.
+        int size;
+        for (size = 4; size > 1; size -= 1) {
+            if (end - size >= min && rx_utf8_char_size(str_size, str, end - size) == size) {
+                break;
+            }
+        }
+        end -= size;
+    } else {
+        end -= 1;
+    }
+    // Only a byte that can't be part of a longer utf8 character is sure to
+    // be where a character starts.
+    int c = rx_span_follow(node->next2);
+    if (c == 256) {
+        while (end >= min && end > 0 && str[end - 1] != '\n') {
+            end -= 1;
+        }
+    } else if (c >= 0 && (body->type != CHAR_CLASS || c < 0x80)) {
+        while (end >= min && (unsigned char) str[end] != c) {
+            end -= 1;
+        }
+    }
+    return end;
+}
+
+// Returns where the run of a lazy span ends when it takes one more character
+// after pos, or -1 if it can't. When what follows is known, it takes all the
+// characters up to where that is instead.
+static int rx_span_next (rx_t *rx, matcher_t *m, node_t *node, int str_size, char *str, int pos) {
+    node_t *body = rx_span_body(node);
+    int next = rx_span(rx, m, body, str_size, str, pos, pos + 1);
+    if (next == pos) {
+        return -1;
+    }
+    int c = rx_span_follow(node->next2);
+    char *p;
+    if (c == 256) {
+        p = memchr(str + next - 1, '\n', str_size - next + 1);
+        p = p ? p + 1 : NULL;
+    } else if (c >= 0 && (body->type != CHAR_CLASS || c < 0x80)) {
+        p = memchr(str + next, c, str_size - next);
+    } else {
+        return next;
+    }
+    // The run has to get to there, or to the end of the string, which is
+    // the last place left to try.
+    int limit = p ? p - str : str_size + 1;
+    int end = rx_span(rx, m, body, str_size, str, next, limit);
+    if (end == limit || end == str_size) {
+        return end;
+    }
+    return -1;
+}
+
+// Returns the first start of a line at or after pos whose byte a match can
+// start with, for a regexp whose matches all start with ^^, or the end of the
+// string if there's none.
+static int rx_next_line (rx_t *rx, int str_size, char *str, int pos) {
+    while (pos < str_size) {
+        if (pos > 0 && str[pos - 1] != '\n') {
+            char *p = memchr(str + pos, '\n', str_size - pos);
+            if (!p) {
+                return str_size;
+            }
+            pos = p - str + 1;
+        } else if (rx->internal->scans && rx->internal->scans->first && !rx_byteset_has(rx->internal->scans->first, str[pos])) {
+            pos += 1;
+        } else {
+            break;
+        }
+    }
+    return pos;
+}
+
+// Returns how many times the backtracker can backtrack from start_pos before
+// it starts over memoized. A regexp that rx_analyze() found could be slow is
+// memoized from the first time.
+static long rx_backtracks_allowed (rx_t *rx, matcher_t *m, int str_size, int start_pos) {
+    if (rx->plan.memoize) {
+        return 0;
+    }
+    return (long) m->backtrack_limit * (str_size - start_pos + 1);
+}
+
+// Matches with the engine the plan picked, the rest of rx_match(). With
+// resume, it goes on from where the backtracker yielded instead.
+//
+// The DFA first runs over the string without keeping any registers, which is
+// the fast part, to find where the match ends and where it could start. The
+// captures are only worked out from there, by the DFA when it can keep them,
+// and otherwise by the backtracker from the start the reverse program finds
+// going back from the end.
+static int rx_match_plan (rx_t *rx, matcher_t *m, int str_size, char *str, int start_pos, int resume) {
+    node_t *node = rx->start;
+    int pos = start_pos;
+    unsigned char c;
+    long backtracks = 0;
+    long backtracks_allowed = rx_backtracks_allowed(rx, m, str_size, start_pos);
+    unsigned char *memo = NULL;
+    int memo_counted = 0;
+    int memo_start = 0;
+    int memo_width = 0;
+    int memo_sop = 0;
+    long steps = 0;
+    long next_check = 0;
+    long long start_time = m->time_limit > 0 ? rx_usec() : 0;
+    long quantum_end = 0;
+    if (rx->counters_count > m->internal->counters_allocated) {
+        m->internal->counters_allocated = rx->counters_count;
+        m->internal->counters = realloc(m->internal->counters, m->internal->counters_allocated * sizeof(int));
+    }
+
+    if (resume) {
+        // Everything else it was using is still in the matcher, the path, the
+        // counters, the memo and the captures so far.
+        resume_t *r = &m->internal->resume;
+        node = r->node;
+        pos = r->pos;
+        start_pos = r->start_pos;
+        backtracks = r->backtracks;
+        backtracks_allowed = r->backtracks_allowed;
+        if (r->memoized) {
+            memo = m->internal->memo;
+        }
+        memo_counted = r->memo_counted;
+        memo_start = r->memo_start;
+        memo_width = r->memo_width;
+        memo_sop = r->memo_sop;
+        start_time -= r->usec;
+        steps = m->steps;
+        if (m->step_quantum > 0) {
+            quantum_end = steps + m->step_quantum + 1;
+        }
+        goto retry;
+    }
+
+    m->success = 0;
+    m->hit_end = 0;
+    m->path_count = 0;
+    m->engine = ENGINE_BACKTRACKER;
+    if (m->step_quantum > 0) {
+        quantum_end = m->step_quantum + 1;
+    }
+
+    if (rx->plan.engine == ENGINE_ONEPASS) {
+        m->engine = ENGINE_ONEPASS;
+        // The regexp starts with ^, so only the first start position can match.
+        // When there's an assertion before the ^, the backtracker would go on
+        // trying start positions until that passes, which could be at the end.
+        if (start_pos == 0 && rx_onepass_match(rx, m, str_size, str, start_pos, start_time)) {
+            return 1;
+        }
+        if (rx->internal->onepass->asserts_first || start_pos >= str_size) {
+            m->hit_end = 1;
+        }
+        return 0;
+    }
+
+    if (rx->plan.engine == ENGINE_REVERSE) {
+        // The regexp ends with $, so find where the leftmost match starts
+        // by going backward from the end, then only try from there.
+        m->hit_end = 1;
+        start_pos = rx_reverse_start(rx, m, str_size, str, start_pos, str_size, start_time);
+        if (start_pos < 0) {
+            m->engine = ENGINE_REVERSE;
+            return 0;
+        }
+        if (rx->internal->tdfa && rx->internal->tdfa->captures) {
+            m->engine = ENGINE_DFA;
+            return rx_tdfa_match(rx, m, str_size, str, start_pos, start_time);
+        }
+        pos = start_pos;
+        backtracks_allowed = rx_backtracks_allowed(rx, m, str_size, start_pos);
+        goto backtrack;
+    }
+
+    if (rx->plan.engine == ENGINE_DFA) {
+        m->engine = ENGINE_DFA;
+        // Find where the match is with the DFA, without keeping track of the
+        // captures, then get the captures starting from there. The DFA only
+        // knows where the match ends and where it could start, so unless it can
+        // get the captures itself, go backward from the end to find the start.
+        if (rx->internal->tdfa->anchored) {
+            // The regexp starts with ^, which fails everything after the start.
+            if (start_pos) {
+                return 0;
+            }
+        } else if (rx->plan.prefilter == PREFILTER_PREFIX) {
+            start_pos = rx_find_literal(str_size, str, start_pos, rx->internal->prefix_size, rx->internal->prefix, rx->internal->prefix_nocase ? rx->internal->prefix_fold : NULL);
+            if (start_pos < 0) {
+                m->hit_end = 1;
+                return 0;
+            }
+        } else if (rx->plan.prefilter == PREFILTER_LITERALS) {
+            start_pos = rx_literals_find(rx->internal->literals, str_size, str, start_pos);
+            if (start_pos < 0) {
+                m->hit_end = 1;
+                return 0;
+            }
+        } else if (rx->plan.prefilter == PREFILTER_LINES) {
+            start_pos = rx_next_line(rx, str_size, str, start_pos);
+        }
+        int first;
+        int end = rx_tdfa_span(rx, m, str_size, str, start_pos, &first, start_time);
+        if (end < 0) {
+            return 0;
+        }
+        if (rx->internal->tdfa->captures) {
+            return rx_tdfa_match(rx, m, str_size, str, first, start_time);
+        }
+        start_pos = first;
+        if (!rx->internal->tdfa->anchored && rx->internal->reverse) {
+            start_pos = rx_reverse_start(rx, m, str_size, str, first, end, start_time);
+            if (start_pos < 0) {
+                return 0;
+            }
+        }
+        pos = start_pos;
+        m->engine = ENGINE_BACKTRACKER;
+        backtracks_allowed = rx_backtracks_allowed(rx, m, str_size, start_pos);
+        goto backtrack;
+    }
+
+    if (rx->plan.prefilter == PREFILTER_PREFIX || rx->plan.prefilter == PREFILTER_LITERALS ||
+        rx->plan.prefilter == PREFILTER_LINES) {
+        goto find_start;
+    } else if (rx->plan.prefilter == PREFILTER_GLUSHKOV) {
+        if (!rx_glushkov_scan(rx->internal->glushkov, str_size, str, start_pos, &start_pos)) {
+            m->hit_end = 1;
+            return 0;
+        }
+        pos = start_pos;
+    } else if (rx->plan.prefilter == PREFILTER_SUFFIX) {
+        // Every match ends with the suffix, so there's none without it.
+        if (rx_find_literal(str_size, str, start_pos, rx->plan.suffix_size, rx->plan.suffix, NULL) < 0) {
+            m->hit_end = 1;
+            return 0;
+        }
+    }
+    if (rx->plan.anchored_line) {
+        start_pos = rx_next_line(rx, str_size, str, start_pos);
+        pos = start_pos;
+    } else if (rx->internal->scans && rx->internal->scans->first && start_pos < str_size) {
+        start_pos = rx_scan(rx->internal->scans->first, str, start_pos, str_size, 1);
+        pos = start_pos;
+    }
+
+    backtrack:
+    while (1) {
+        retry:
+        steps += 1;
+        if (steps >= next_check) {
+            m->result = rx_limits(m, steps, start_time, quantum_end, &next_check);
+            if (m->result == RESULT_IN_PROGRESS) {
+                resume_t *r = &m->internal->resume;
+                r->node = node;
+                r->pos = pos;
+                r->start_pos = start_pos;
+                r->backtracks = backtracks;
+                r->backtracks_allowed = backtracks_allowed;
+                r->memoized = memo != NULL;
+                r->memo_counted = memo_counted;
+                r->memo_start = memo_start;
+                r->memo_width = memo_width;
+                r->memo_sop = memo_sop;
+                r->usec = m->time_limit > 0 ? rx_usec() - start_time : 0;
+            }
+            if (m->result) {
+                return 0;
+            }
+        }
+
+        switch (node->type) {
+        case TAKE:
+        case TAKE_NOCASE:
+            if (pos >= str_size) {
+                m->hit_end = 1;
+                goto try_alternative;
+            }
+            c = str[pos];
+            if (node->type == TAKE ? c == node->value : (c | 0x20) == node->value) {
+                if (rx->internal->runs && rx->internal->runs->size[node->index]) {
+                    // The rest of a run of characters is compared all at once.
+                    int run = rx_run_match(rx->internal->runs, node, str_size, str, pos + 1);
+                    if (run < 0) {
+                        m->hit_end = 1;
+                        goto try_alternative;
+                    }
+                    if (!run) {
+                        break;
+                    }
+                    pos += rx->internal->runs->size[node->index];
+                    node = rx->internal->runs->next[node->index];
+                    continue;
+                }
+                node = node->next;
+                pos += 1;
+                continue;
+            }
+            break;
+
+        case MATCH_END:
+            m->steps = steps;
+            return rx_match_end(rx, m, node, str, start_pos, pos);
+            break;
+
+        case BRANCH: {
+            int row = memo ? rx_memo_row(rx, m, node, memo_counted) : -1;
+            if (row >= 0) {
+                // Coming back to a branch at the same position only happens
+                // after everything from it has already failed.
+                int bit = row * memo_width + pos - memo_start;
+                if (memo[bit >> 3] & (1 << (bit & 7))) {
+                    break;
+                }
+                memo[bit >> 3] |= 1 << (bit & 7);
+            }
+            if (rx->internal->empty_loops && rx->internal->empty_loops[node->index]) {
+                // Going through this branch again at a position it already
+                // went through it at would be going around a loop without
+                // taking anything, which could go on forever.
+                if (rx_empty_loop(rx, m, node, pos)) {
+                    break;
+                }
+                rx_path_push(m, node, pos);
+                node = node->next;
+                continue;
+            }
+            if (rx->internal->dispatch && rx->internal->dispatch->jump[node->index] && pos < str_size &&
+                ((unsigned char) str[pos] < 0xc0 || str_size - pos >= 4) &&
+                (!m->backtrack_limit || memo || backtracks_allowed < 0 || backtracks < backtracks_allowed)) {
+                // Go straight to the first alternative that can start with the
+                // next byte. A byte that starts a utf8 character cut off by the
+                // end of the string is left to the nodes, which set hit_end.
+                // Skipping the others counts as backtracking, so a loop that
+                // never takes anything still ends up memoized.
+                node_t *node2 = rx->internal->dispatch->jump[node->index][(unsigned char) str[pos]];
+                if (node2 != node) {
+                    backtracks += 1;
+                    node = node2;
+                    if (!node) {
+                        break;
+                    }
+                    continue;
+                }
+            }
+            rx_path_push(m, node, pos);
+            node = node->next;
+            continue;
+            break;
+        }
+
+        case CAPTURE_START:
+        case CAPTURE_END:
+            rx_path_push(m, node, pos);
+            node = node->next;
+            continue;
+            break;
+
+        case GROUP_START:
+        case GROUP_END:
+            node = node->next;
+            continue;
+            break;
 
         case ASSERTION:
+            if (pos >= str_size && node->value != ASSERT_SOS && node->value != ASSERT_SOL && node->value != ASSERT_SOP) {
+                m->hit_end = 1;
+            }
             if (rx_match_assertion(node->value, start_pos, str_size, str, pos)) {
                 node = node->next;
                 continue;
@@ -1278,9 +5623,14 @@ int rx_match (rx_t *rx, matcher_t *m, int str_size, char *str, int start_pos) {
 
         case CHAR_CLASS:
             if (pos >= str_size) {
+                m->hit_end = 1;
                 goto try_alternative;
             }
             int test_size = rx_utf8_char_size(str_size, str, pos);
+            if (test_size == 1 && (str[pos] & 0xc0) == 0xc0 && str_size - pos < 4) {
+                // A utf8 character that might have been cut off by the end of the string
+                m->hit_end = 1;
+            }
             char *test = str + pos;
             char_class_t *ccval = node->ccval;
 
@@ -1288,72 +5638,18 @@ int rx_match (rx_t *rx, matcher_t *m, int str_size, char *str, int start_pos) {
                 pos += test_size;
                 node = node->next;
                 continue;
-            } else if (rx->ignorecase) {
-                // If retrying because of ignorecase, copy the char to a buffer to
-                // change the case of what's being tested.
-                unsigned char retry_buf[4];
-                memcpy(retry_buf, test, test_size);
-                if (flip_case(retry_buf)) {
-                    if (rx_match_char_class(rx, ccval, test_size, (char *) retry_buf)) {
-                        pos += test_size;
-                        node = node->next;
-                        continue;
-                    }
-                }
             }
             break;
 
         case CHAR_SET:
             if (pos >= str_size) {
+                m->hit_end = 1;
                 goto try_alternative;
             }
-            c = str[pos];
-            if (node->value == CS_ANY) {
+            if (rx_match_char_set(node->value, str[pos])) {
                 pos += 1;
                 node = node->next;
                 continue;
-            } else if (node->value == CS_NOTNL) {
-                if (c != '\n') {
-                    pos += 1;
-                    node = node->next;
-                    continue;
-                }
-            } else if (node->value == CS_DIGIT) {
-                if (c >= '0' && c <= '9') {
-                    pos += 1;
-                    node = node->next;
-                    continue;
-                }
-            } else if (node->value == CS_NOTDIGIT) {
-                if (!(c >= '0' && c <= '9')) {
-                    pos += 1;
-                    node = node->next;
-                    continue;
-                }
-            } else if (node->value == CS_WORD) {
-                if ((c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c == '_')) {
-                    pos += 1;
-                    node = node->next;
-                    continue;
-                }
-            } else if (node->value == CS_NOTWORD) {
-                if (!((c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c == '_'))) {
-                    pos += 1;
-                    node = node->next;
-                    continue;
-                }
-            } else if (node->value == CS_SPACE) {
-                if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
-                    pos += 1;
-                    node = node->next;
-                    continue;
-                }
-            } else if (node->value == CS_NOTSPACE) {
-                if (!(c == ' ' || c == '\t' || c == '\n' || c == '\r')) {
-                    pos += 1;
-                    node = node->next;
-                    continue;
-                }
             }
             break;
 
@@ -1361,18 +5657,165 @@ int rx_match (rx_t *rx, matcher_t *m, int str_size, char *str, int start_pos) {
             node = node->next;
             continue;
             break;
+
+        case SPAN:
+            if (memo) {
+                // The memo only knows about the branches of the loop.
+                node = node->next;
+                continue;
+            }
+            if (rx->internal->empty_loops && rx->internal->empty_loops[node->index] && rx_empty_loop(rx, m, node, pos)) {
+                break;
+            }
+            node_t *body = rx_span_body(node);
+            int end = rx_span(rx, m, body, str_size, str, pos, str_size + 1);
+            if (body == node->next) {
+                // It's a +, so it needs one character to begin with.
+                if (end == pos) {
+                    break;
+                }
+                pos += body->type == CHAR_CLASS ? rx_utf8_char_size(str_size, str, pos) : 1;
+            }
+            rx_path_push(m, node, pos);
+            m->path[m->path_count - 1].pos2 = end;
+            pos = end;
+            node = node->next2;
+            continue;
+            break;
+
+        case ATOMIC_START:
+            rx_path_push(m, node, pos);
+            node = node->next;
+            continue;
+            break;
+
+        case ATOMIC_END:
+            rx_path_atomic(m);
+            node = node->next;
+            continue;
+            break;
+
+        case COUNT_START:
+        case COUNT: {
+            // The entry in the path has the counter from before, to put back
+            // when backtracking past it.
+            rx_path_push(m, node, pos);
+            m->path[m->path_count - 1].pos2 = m->internal->counters[node->value];
+            if (node->type == COUNT_START) {
+                m->internal->counters[node->value] = -1;
+                node = node->next;
+                continue;
+            }
+            quantifier_t *qval = rx->counters + node->value;
+            int count = m->internal->counters[node->value] += 1;
+            node_t *branch = node->next;
+            if (count < qval->min) {
+                node = qval->greedy ? branch->next : branch->next2;
+            } else if (qval->max != -1 && count >= qval->max) {
+                node = qval->greedy ? branch->next2 : branch->next;
+            } else {
+                node = branch;
+            }
+            continue;
+            break;
+        }
+
+        case SPAN_LAZY:
+            if (memo) {
+                node = node->next;
+                continue;
+            }
+            if (rx->internal->empty_loops && rx->internal->empty_loops[node->index] && rx_empty_loop(rx, m, node, pos)) {
+                break;
+            }
+            if (rx_span_body(node) == node->next) {
+                int next = rx_span(rx, m, node->next, str_size, str, pos, pos + 1);
+                if (next == pos) {
+                    break;
+                }
+                pos = next;
+            }
+            rx_path_push(m, node, pos);
+            node = node->next2;
+            continue;
+            break;
         }
 
         try_alternative:
 
+        backtracks += 1;
+        if (m->backtrack_limit && !memo && backtracks_allowed >= 0 && backtracks > backtracks_allowed) {
+            // It's backtracking too much for the size of the string, so start
+            // this start position over, remembering the branches and
+            // positions it's been to, so it doesn't go the same way twice.
+            memo_width = str_size - start_pos + 1;
+            memo_counted = rx_memo_size(rx, 1, memo_width) <= RX_MEMO_MAX_SIZE;
+            long size = rx_memo_size(rx, memo_counted, memo_width);
+            if (size <= RX_MEMO_MAX_SIZE) {
+                if (size > m->internal->memo_allocated) {
+                    m->internal->memo_allocated = size;
+                    m->internal->memo = realloc(m->internal->memo, m->internal->memo_allocated);
+                }
+                memo = m->internal->memo;
+                memset(memo, 0, size);
+                memo_start = start_pos;
+                for (int i = 0; i < rx->nodes_count; i += 1) {
+                    if (rx->nodes[i]->type == ASSERTION && rx->nodes[i]->value == ASSERT_SOP) {
+                        memo_sop = 1;
+                    }
+                }
+                m->engine = ENGINE_MEMOIZED;
+                m->path_count = 0;
+                pos = start_pos;
+                node = rx->start;
+                goto retry;
+            }
+            backtracks_allowed = -1;
+        }
+
         for (int i = m->path_count - 1; i >= 0; i--) {
             path_t *p = m->path + i;
+            if (p->node->type == COUNT_START || p->node->type == COUNT) {
+                m->internal->counters[p->node->value] = p->pos2;
+                continue;
+            }
             if (p->node->type == BRANCH) {
+                if (p->pos2 < 0) {
+                    continue;
+                }
                 node = p->node->next2;
                 pos = p->pos;
                 m->path_count = i;
+                if (rx->internal->empty_loops && rx->internal->empty_loops[p->node->index]) {
+                    // Its entry stays, marked as having tried both ways, for
+                    // looking up where it's been.
+                    p->pos2 = -1;
+                    m->path_count = i + 1;
+                }
                 goto retry;
             }
+            if (p->node->type == SPAN && p->pos2 > p->pos) {
+                // Give back the run a character at a time, or up to where
+                // what follows could match.
+                p->pos2 = rx_span_back(p->node, str_size, str, p->pos, p->pos2);
+                if (p->pos2 >= p->pos) {
+                    node = p->node->next2;
+                    pos = p->pos2;
+                    m->path_count = i + 1;
+                    goto retry;
+                }
+            }
+            if (p->node->type == SPAN_LAZY) {
+                int next = rx_span_next(rx, m, p->node, str_size, str, p->pos);
+                if (next >= 0) {
+                    p->pos = next;
+                    p->pos2 = next;
+                    node = p->node->next2;
+                    pos = next;
+                    m->path_count = i + 1;
+                    goto retry;
+                }
+            }
         }
 
         // Try another start position.
@@ -1383,11 +5826,246 @@ int rx_match (rx_t *rx, matcher_t *m, int str_size, char *str, int start_pos) {
         start_pos += 1;
         pos = start_pos;
         node = rx->start;
+        if (memo_sop) {
+            // The branches after a \G might go differently from another start.
+            memset(memo, 0, rx_memo_size(rx, memo_counted, memo_width));
+        }
+
+        find_start:
+        if (rx->internal->prefix_size) {
+            // Skip the start positions that can't match because the string
+            // every match starts with isn't there.
+            start_pos = rx_find_literal(str_size, str, start_pos, rx->internal->prefix_size, rx->internal->prefix, rx->internal->prefix_nocase ? rx->internal->prefix_fold : NULL);
+            if (start_pos < 0) {
+                m->hit_end = 1;
+                break;
+            }
+            pos = start_pos;
+        } else if (rx->internal->literals) {
+            // Or because none of the literals a match starts with are there.
+            start_pos = rx_literals_find(rx->internal->literals, str_size, str, start_pos);
+            if (start_pos < 0) {
+                m->hit_end = 1;
+                break;
+            }
+            pos = start_pos;
+        } else if (rx->plan.anchored_line) {
+            start_pos = rx_next_line(rx, str_size, str, start_pos);
+            pos = start_pos;
+        } else if (rx->internal->scans && rx->internal->scans->first && start_pos < str_size) {
+            // Skip the start positions whose byte no match starts with. With
+            // none left, it tries the end of the string like it would have.
+            start_pos = rx_scan(rx->internal->scans->first, str, start_pos, str_size, 1);
+            pos = start_pos;
+        }
     }
     out:
+    m->steps = steps;
     return 0;
 }
 
+// rx_match() will match a regexp against a given string. The strings it finds
+// will be stored in the matcher argument. The start position can be given, but usually
+// it would be 0 for the start of the string. Returns 1 on success and 0 on failure.
+//
+// The same matcher object can be used multiple times which will reuse the
+// memory allocated for previous matches. All the captures are references into the
+// original string.
+//
+// If the result depended on looking at the end of the string, m->hit_end is set.
+// When str is only a window into a longer input, that means the result could be
+// different once more of the input is available.
+//
+// m->step_limit stops the backtracker once it's taken that many steps. Each step
+// is a node it goes to, and m->steps says how many it took. m->time_limit, in
+// microseconds, and setting m->cancel from another thread stop whichever engine
+// is matching, which looks at them every so many steps or bytes. m->result says
+// if it stopped for one of those, or otherwise if it matched.
+//
+// With m->step_quantum set, the backtracker returns after that many steps with
+// m->result set to RESULT_IN_PROGRESS, and rx_match_resume() goes on from there.
+int rx_match (rx_t *rx, matcher_t *m, int str_size, char *str, int start_pos) {
+    m->result = RESULT_NO_MATCH;
+    m->steps = 0;
+    if (rx_match_plan(rx, m, str_size, str, start_pos, 0)) {
+        m->result = RESULT_MATCH;
+        return 1;
+    }
+    return 0;
+}
+
+// rx_match_resume() goes on with a match that rx_match() returned from with
+// m->result set to RESULT_IN_PROGRESS, for another m->step_quantum steps. It has
+// to be given the same regexp and string. This way one thread can take turns
+// going through many long matches. Returns 1 on success and 0 on failure or if
+// it's still in progress, like rx_match(). After it's done, it returns what the
+// match came to.
+int rx_match_resume (rx_t *rx, matcher_t *m, int str_size, char *str) {
+    if (m->result != RESULT_IN_PROGRESS) {
+        return m->result == RESULT_MATCH;
+    }
+    m->result = RESULT_NO_MATCH;
+    if (rx_match_plan(rx, m, str_size, str, m->internal->resume.start_pos, 1)) {
+        m->result = RESULT_MATCH;
+        return 1;
+    }
+    return 0;
+}
+
+// Prints a literal with the bytes that aren't printable escaped.
+static void rx_explain_literal (int size, char *str) {
+    printf("\"");
+    for (int i = 0; i < size; i += 1) {
+        unsigned char c = str[i];
+        if (c == '"' || c == '\\') {
+            printf("\\%c", c);
+        } else if (c >= 0x20 && c < 0x7f) {
+            printf("%c", c);
+        } else {
+            printf("\\x%02x", c);
+        }
+    }
+    printf("\"");
+}
+
+static void rx_explain_byte (int c) {
+    if (c > 0x20 && c < 0x7f && c != '-' && c != '\\' && c != ']') {
+        printf("%c", c);
+    } else {
+        printf("\\x%02x", c);
+    }
+}
+
+// rx_explain() prints how rx_match() goes about matching the regexp, and about
+// how much work that is.
+void rx_explain (rx_t *rx) {
+    plan_t *plan = &rx->plan;
+    printf("engine: ");
+    if (plan->engine == ENGINE_ONEPASS) {
+        printf("one-pass, %d states\n", rx->internal->onepass->states_count);
+    } else if (plan->engine == ENGINE_REVERSE) {
+        printf("reverse from the end of the string, then %s from where the match starts\n",
+            rx->internal->tdfa && rx->internal->tdfa->captures ? "the tagged DFA" : "the backtracker");
+    } else if (plan->engine == ENGINE_DFA) {
+        printf("tagged DFA, %d states, %s\n", rx->internal->tdfa->states_count,
+            rx->internal->tdfa->captures ? "gets the captures" : "then the backtracker for the captures");
+    } else {
+        printf("backtracker\n");
+    }
+
+    printf("prefilter: ");
+    if (plan->prefilter == PREFILTER_PREFIX) {
+        printf("literal prefix ");
+        rx_explain_literal(rx->internal->prefix_size, rx->internal->prefix);
+        printf("%s\n", rx->internal->prefix_nocase ? ", ignoring case" : "");
+    } else if (plan->prefilter == PREFILTER_LITERALS) {
+        printf("%d literals", rx->internal->literals->count);
+        for (int i = 0; i < rx->internal->literals->count; i += 1) {
+            printf(i ? ", " : " ");
+            rx_explain_literal(rx->internal->literals->size[i], rx->internal->literals->str[i]);
+        }
+        printf("\n");
+    } else if (plan->prefilter == PREFILTER_LINES) {
+        printf("start of lines\n");
+    } else if (plan->prefilter == PREFILTER_GLUSHKOV) {
+        printf("Glushkov automaton\n");
+    } else if (plan->prefilter == PREFILTER_SUFFIX) {
+        printf("literal suffix ");
+        rx_explain_literal(plan->suffix_size, plan->suffix);
+        printf("\n");
+    } else {
+        printf("none\n");
+    }
+
+    printf("anchored: %s\n",
+        plan->anchored_start && plan->anchored_end ? "start and end" :
+        plan->anchored_start ? "start" : plan->anchored_line && plan->anchored_end ? "start of a line and end" :
+        plan->anchored_line ? "start of a line" : plan->anchored_end ? "end" : "no");
+    if (rx->internal->prefix_size) {
+        printf("prefix: ");
+        rx_explain_literal(rx->internal->prefix_size, rx->internal->prefix);
+        printf("\n");
+    }
+    if (plan->suffix_size) {
+        printf("suffix: ");
+        rx_explain_literal(plan->suffix_size, plan->suffix);
+        printf("\n");
+    }
+
+    printf("first bytes: ");
+    int count = 0;
+    for (int c = 0; c < 256; c += 1) {
+        count += (plan->first_bytes[c >> 3] >> (c & 7)) & 1;
+    }
+    if (count == 256) {
+        printf("any\n");
+    } else {
+        printf("[");
+        for (int c = 0; c < 256; c += 1) {
+            if (!(plan->first_bytes[c >> 3] & (1 << (c & 7)))) {
+                continue;
+            }
+            int c2 = c;
+            while (c2 + 1 < 256 && plan->first_bytes[(c2 + 1) >> 3] & (1 << ((c2 + 1) & 7))) {
+                c2 += 1;
+            }
+            rx_explain_byte(c);
+            if (c2 > c) {
+                if (c2 > c + 1) {
+                    printf("-");
+                }
+                rx_explain_byte(c2);
+            }
+            c = c2;
+        }
+        printf("]\n");
+    }
+
+    printf("min size: %d\n", plan->min_size);
+    printf("captures: %d\n", rx->cap_count);
+    printf("nodes: %d\n", rx->nodes_count);
+    if (rx->counters_count) {
+        printf("counters: %d\n", rx->counters_count);
+    }
+    if (rx->internal->dispatch) {
+        printf("jump tables: %d\n", rx->internal->dispatch->count);
+    }
+    if (rx->complexity == COMPLEXITY_LINEAR) {
+        printf("complexity: linear\n");
+    } else if (rx->complexity != COMPLEXITY_UNKNOWN || rx->complexitystr) {
+        printf("complexity: %s\n", rx->complexitystr);
+    }
+
+    printf("cost: ");
+    if (plan->engine != ENGINE_BACKTRACKER) {
+        printf("linear\n");
+        return;
+    }
+    int branches = 0;
+    int nomemo_branches = 0;
+    for (int i = 0; i < rx->nodes_count; i += 1) {
+        branches += rx->nodes[i]->type == BRANCH;
+        nomemo_branches += rx->nodes[i]->type == BRANCH && rx->internal->memo_layout->nomemo[i];
+    }
+    // The branches in counted loops have a row of the memo for each count.
+    int rows = rx->internal->memo_layout->rows;
+    if (!branches) {
+        printf("up to %d steps at each start position\n", rx->nodes_count);
+    } else if (nomemo_branches) {
+        // Those in atomic groups and nested counted loops can't be memoized.
+        printf("%d branch%s, exponential at worst, %d of them can't be memoized\n",
+            branches, branches == 1 ? "" : "es", nomemo_branches);
+    } else if (plan->memoize) {
+        printf("%d branch%s, memoized from the start, up to %d steps per byte for strings up to %ld bytes\n",
+            branches, branches == 1 ? "" : "es", rows, (long) RX_MEMO_MAX_SIZE * 8 / rows);
+    } else {
+        // Once it backtracks too much it remembers where it's been, which
+        // bounds it by the size of the memo.
+        printf("%d branch%s, exponential at worst, up to %d steps per byte once memoized for strings up to %ld bytes\n",
+            branches, branches == 1 ? "" : "es", rows, (long) RX_MEMO_MAX_SIZE * 8 / rows);
+    }
+}
+
 void rx_matcher_free (matcher_t *m) {
     free(m->path);
     free(m->cap_start);
@@ -1395,6 +6073,10 @@ void rx_matcher_free (matcher_t *m) {
     free(m->cap_defined);
     free(m->cap_str);
     free(m->cap_size);
+    free(m->internal->regs);
+    free(m->internal->memo);
+    free(m->internal->counters);
+    free(m->internal);
     free(m);
 }
 
@@ -13,6 +13,13 @@ enum {
     CHAR_SET,
     GROUP_START,
     GROUP_END,
+    TAKE_NOCASE,
+    SPAN,
+    SPAN_LAZY,
+    ATOMIC_START,
+    ATOMIC_END,
+    COUNT_START,
+    COUNT,
 };
 
 enum {
@@ -25,6 +32,39 @@ enum {
     ASSERT_EOW, // end of word
 };
 
+enum {
+    ENGINE_BACKTRACKER, // backtracking
+    ENGINE_MEMOIZED,    // backtracking, remembering where it already failed
+    ENGINE_ONEPASS,     // one-pass table
+    ENGINE_DFA,         // tagged DFA
+    ENGINE_REVERSE,     // reverse program from the end of the string
+};
+
+enum {
+    PREFILTER_NONE,     // every start position is tried
+    PREFILTER_PREFIX,   // skips to where the literal every match starts with is
+    PREFILTER_GLUSHKOV, // skips to where the Glushkov automaton first accepts
+    PREFILTER_SUFFIX,   // fails if the literal every match ends with isn't there
+    PREFILTER_LITERALS, // skips to where one of the literals a match starts with is
+    PREFILTER_LINES,    // skips to the start of the next line
+};
+
+enum {
+    RESULT_NO_MATCH,    // there's no match
+    RESULT_MATCH,       // there's a match
+    RESULT_STEP_LIMIT,  // stopped after m->step_limit steps
+    RESULT_TIME_LIMIT,  // stopped after m->time_limit microseconds
+    RESULT_CANCELED,    // stopped because m->cancel was set
+    RESULT_IN_PROGRESS, // stopped after m->step_quantum steps, to be resumed
+};
+
+enum {
+    COMPLEXITY_UNKNOWN,     // not analyzed, or too big to
+    COMPLEXITY_LINEAR,      // the backtracker is linear at each start position
+    COMPLEXITY_POLYNOMIAL,  // n to the power of complexity_degree at worst
+    COMPLEXITY_EXPONENTIAL, // exponential at worst
+};
+
 enum {
     CS_ANY,
     CS_NOTNL,
@@ -56,6 +96,7 @@ typedef struct {
     int min;
     int max;
     int greedy;
+    int possessive;
 } quantifier_t;
 
 typedef struct {
@@ -68,6 +109,10 @@ typedef struct {
     char *char_sets;
     int str_size;
     char *str;
+    char fold;
+    unsigned char bytes[32];
+    int intervals_count;
+    unsigned int *intervals;
 } char_class_t;
 
 struct node_t {
@@ -78,8 +123,28 @@ struct node_t {
         node_t *next2;
         char_class_t *ccval;
     };
+    int index;
+    int pos;
 };
 
+typedef struct rx_internal_t rx_internal_t;
+typedef struct matcher_internal_t matcher_internal_t;
+
+// What rx_init() found out about a regexp, and how rx_match() will go about
+// matching it because of that.
+typedef struct {
+    int engine;
+    int prefilter;
+    int anchored_start;
+    int anchored_line;
+    int anchored_end;
+    int memoize;
+    int min_size;
+    int suffix_size;
+    char *suffix;
+    unsigned char first_bytes[32];
+} plan_t;
+
 typedef struct {
     node_t *start;
     int regexp_size;
@@ -93,19 +158,30 @@ typedef struct {
     node_t **or_end;
     int error;
     char *errorstr;
-    int ignorecase;
+    int analyze;
+    int complexity;
+    int complexity_degree;
+    int complexity_pos;
+    int complexity_size;
+    char *complexitystr;
     int char_classes_count;
     int char_classes_allocated;
     char_class_t **char_classes;
+    int counters_count;
+    int counters_allocated;
+    quantifier_t *counters;
     int dfs_stack_count;
     int dfs_stack_allocated;
     node_t **dfs_stack;
     hash_t *dfs_map;
+    plan_t plan;
+    rx_internal_t *internal;
 } rx_t;
 
 typedef struct {
     node_t *node;
     int pos;
+    int pos2;
 } path_t;
 
 // The matcher maintains a list of positions that are important for backtracking
@@ -123,6 +199,16 @@ typedef struct {
     int *cap_size;
     int success;
     int value;
+    int hit_end;
+    int engine;
+    int backtrack_limit;
+    long step_limit;
+    long time_limit;
+    volatile int cancel;
+    int result;
+    long steps;
+    long step_quantum;
+    matcher_internal_t *internal;
 } matcher_t;
 
 rx_t *rx_alloc ();
@@ -131,8 +217,10 @@ int rx_init (rx_t *rx, int regexp_size, char *regexp);
 int rx_init_start (rx_t *rx, int regexp_size, char *regexp, node_t *start, int value);
 node_t *rx_node_create (rx_t *rx);
 void rx_print (rx_t *rx);
+void rx_explain (rx_t *rx);
 void rx_match_print (matcher_t *m);
 int rx_match (rx_t *rx, matcher_t *m, int str_size, char *str, int start_pos);
+int rx_match_resume (rx_t *rx, matcher_t *m, int str_size, char *str);
 int rx_hex_to_int (char *str, int size, unsigned int *dest);
 int rx_int_to_utf8 (unsigned int value, char *str);
 int rx_utf8_char_size (int str_size, char *str, int pos);
@@ -458,6 +458,296 @@ void run_test (int line) {
     printf("\n");
 }
 
+// Prints the result of a test that's done in C instead of coming from
+// testdata.txt, for what matching sets in the matcher besides the captures.
+void ok (int pass, char *name) {
+    test_count += 1;
+    if (!pass) {
+        failed_tests += 1;
+        printf("\x1b[1;31mnot ");
+    }
+    printf("ok %d - %s\n", test_count, name);
+    if (!pass) {
+        printf("\x1b[0m");
+    }
+    printf("\n");
+}
+
+// Returns a string of size copies of c, followed by end if it isn't 0.
+char *repeat_str (int size, char c, char end) {
+    char *str = malloc(size + 1);
+    memset(str, c, size);
+    str[size] = end;
+    return str;
+}
+
+void test_limits () {
+    rx_t *rx = rx_alloc();
+    matcher_t *m = rx_matcher_alloc();
+    char *str = repeat_str(40, 'a', 0);
+
+    // This backtracks through every way of splitting the a's between the
+    // two alternatives, which is too many to finish without the memo.
+    char regexp[] = "(a|a)*(?>a*)a";
+    rx_init(rx, sizeof(regexp) - 1, regexp);
+    m->backtrack_limit = 0;
+
+    m->step_limit = 1000;
+    int r = rx_match(rx, m, 30, str, 0);
+    ok(!r && m->result == RESULT_STEP_LIMIT && m->steps == 1000, "step_limit stops the backtracker");
+    m->step_limit = 0;
+
+    m->time_limit = 1000;
+    r = rx_match(rx, m, 40, str, 0);
+    ok(!r && m->result == RESULT_TIME_LIMIT, "time_limit stops the backtracker");
+    m->time_limit = 0;
+
+    m->cancel = 1;
+    r = rx_match(rx, m, 40, str, 0);
+    ok(!r && m->result == RESULT_CANCELED, "cancel stops the backtracker");
+    m->cancel = 0;
+
+    r = rx_match(rx, m, 10, str, 0);
+    ok(!r && m->result == RESULT_NO_MATCH, "result is RESULT_NO_MATCH after a limit stopped it");
+    char regexp2[] = "(a|a)*a";
+    rx_init(rx, sizeof(regexp2) - 1, regexp2);
+    r = rx_match(rx, m, 10, str, 0);
+    ok(r && m->result == RESULT_MATCH, "result is RESULT_MATCH");
+    free(str);
+
+    // The other engines look at the clock and at m->cancel every so many bytes,
+    // so these take a string long enough for that.
+    char *regexps[] = {"(a|b)*c", "^(a|b)*c", "x(a|b)*$", "((a|b)*)c"};
+    int size = 1 << 20;
+    str = repeat_str(size, 'a', 0);
+    for (int i = 0; i < 4; i += 1) {
+        rx_init(rx, strlen(regexps[i]), regexps[i]);
+        char name[100];
+        m->time_limit = 1;
+        r = rx_match(rx, m, size, str, 0);
+        snprintf(name, sizeof(name), "time_limit stops %s", regexps[i]);
+        ok(!r && m->result == RESULT_TIME_LIMIT && m->engine != ENGINE_BACKTRACKER, name);
+        m->time_limit = 0;
+        m->cancel = 1;
+        r = rx_match(rx, m, size, str, 0);
+        snprintf(name, sizeof(name), "cancel stops %s", regexps[i]);
+        ok(!r && m->result == RESULT_CANCELED && m->engine != ENGINE_BACKTRACKER, name);
+        m->cancel = 0;
+    }
+    free(str);
+    rx_matcher_free(m);
+    rx_free(rx);
+}
+
+// A counted loop around alternatives that can take different amounts of the
+// string splits it every possible way before failing, unless the memo
+// remembers the branches for each count. The step limit stands in for a time
+// limit, it's far more than the memoized backtracker takes.
+void test_counted_memo () {
+    rx_t *rx = rx_alloc();
+    matcher_t *m = rx_matcher_alloc();
+    char regexp[] = "x(?:a|aa){1,200}c";
+    rx_init(rx, sizeof(regexp) - 1, regexp);
+    int size = 64;
+    char *str = repeat_str(size + 5, 'a', 0);
+    str[0] = 'x';
+    memcpy(str + size + 1, "bxac", 4);
+    m->step_limit = 1000000;
+    int r = rx_match(rx, m, size + 5, str, 0);
+    ok(r && m->result == RESULT_MATCH && m->cap_str[0] == str + size + 2, "x(?:a|aa){1,200}c is memoized");
+    free(str);
+    rx_matcher_free(m);
+    rx_free(rx);
+}
+
+// Matching with a step quantum and resuming until it's done has to come to
+// the same result and captures as matching all at once, for each quantum up to
+// 100. These go through the backtracker, the last one memoized.
+void test_resume () {
+    char *tests[][2] = {
+        {"(a|ab)(?>c|bcd)(d*)", "xabcd"},
+        {"(\\w+)(?>\\s+)(\\w+)", "the cat sat"},
+        {"(?>a+)b|(a)(c)", "aaac"},
+        {"(?:(a)|b){2,5}?c", "ababac"},
+        {"(?:a|b){20,30}+c", "abababababababababababababc"},
+        {"x(a|aa){1,200}c", "xaaaaaaaaaaaaaaaaaaaabxac"},
+    };
+    int count = sizeof(tests) / sizeof(tests[0]);
+    rx_t *rx = rx_alloc();
+    matcher_t *m = rx_matcher_alloc();
+    matcher_t *m2 = rx_matcher_alloc();
+    for (int i = 0; i < count; i += 1) {
+        char *regexp = tests[i][0];
+        char *str = tests[i][1];
+        int str_size = strlen(str);
+        rx_init(rx, strlen(regexp), regexp);
+        int r = rx_match(rx, m, str_size, str, 0);
+        int pass = 1;
+        for (int quantum = 1; quantum <= 100 && pass; quantum += 1) {
+            m2->step_quantum = quantum;
+            int r2 = rx_match(rx, m2, str_size, str, 0);
+            while (m2->result == RESULT_IN_PROGRESS) {
+                r2 = rx_match_resume(rx, m2, str_size, str);
+            }
+            if (r2 != r || m2->result != m->result || m2->steps != m->steps) {
+                pass = 0;
+                break;
+            }
+            for (int j = 0; r && j < m->cap_count; j += 1) {
+                if (m2->cap_defined[j] != m->cap_defined[j] ||
+                    (m->cap_defined[j] && (m2->cap_str[j] != m->cap_str[j] || m2->cap_size[j] != m->cap_size[j]))) {
+                    pass = 0;
+                }
+            }
+        }
+        char name[100];
+        snprintf(name, sizeof(name), "resuming %s gets what matching it all at once does", regexp);
+        ok(pass, name);
+    }
+    rx_matcher_free(m);
+    rx_matcher_free(m2);
+    rx_free(rx);
+}
+
+// What rx_analyze() finds the backtracker could take at worst for a few
+// regexps, which it only does with rx->analyze set, and the part of the regexp
+// it says that's because of, which takes in whole groups.
+void test_complexity () {
+    struct {
+        char *regexp;
+        int complexity;
+        int degree;
+        int pos;
+        int size;
+        char *str;
+    } tests[] = {
+        {"(a*)*b", COMPLEXITY_EXPONENTIAL, 0, 0, 5, "Exponential because of (a*)*."},
+        {"(a|a)*b", COMPLEXITY_EXPONENTIAL, 0, 0, 6, "Exponential because of (a|a)*."},
+        {"(?:a+)+b", COMPLEXITY_EXPONENTIAL, 0, 0, 7, "Exponential because of (?:a+)+."},
+        {"a*a*b", COMPLEXITY_POLYNOMIAL, 2, 0, 4, "Polynomial of degree 2 because of a*a*."},
+        {"(\\d+)-(\\d+) (\\w+)\\>(.*)$", COMPLEXITY_POLYNOMIAL, 2, 12, 11, "Polynomial of degree 2 because of (\\w+)\\>(.*)."},
+        {"abc", COMPLEXITY_LINEAR, 1, 0, 0, NULL},
+        {"[a-z]+", COMPLEXITY_LINEAR, 1, 0, 0, NULL},
+    };
+    char *names[] = {"unknown", "linear", "polynomial", "exponential"};
+    int count = sizeof(tests) / sizeof(tests[0]);
+    for (int i = 0; i < count; i += 1) {
+        rx_t *rx = rx_alloc();
+        rx->analyze = 1;
+        rx_init(rx, strlen(tests[i].regexp), tests[i].regexp);
+        int pass = rx->complexity == tests[i].complexity && rx->complexity_degree == tests[i].degree;
+        if (tests[i].str) {
+            pass = pass && rx->complexitystr && !strcmp(rx->complexitystr, tests[i].str) &&
+                rx->complexity_pos == tests[i].pos && rx->complexity_size == tests[i].size;
+        } else {
+            pass = pass && !rx->complexitystr;
+        }
+        char name[100];
+        snprintf(name, sizeof(name), "%s is %s", tests[i].regexp, names[tests[i].complexity]);
+        ok(pass, name);
+        rx_free(rx);
+    }
+}
+
+// How rx_init() plans to match a few regexps, and which engine rx_match()
+// used. The DFA leaves the captures to the backtracker once it has found the
+// match. There are no backreferences, so an atomic group stands in for what
+// only the backtracker can match, and it switches to the memo once it has
+// backtracked too much.
+void test_plan () {
+    struct {
+        char *regexp;
+        char *str;
+        int engine;
+        int prefilter;
+        int used;
+    } tests[] = {
+        {"abc", "xxabc", ENGINE_DFA, PREFILTER_PREFIX, ENGINE_DFA},
+        {"^(a|b)*c", "abac", ENGINE_ONEPASS, PREFILTER_NONE, ENGINE_ONEPASS},
+        {"(?:a|b)*c", "xabac", ENGINE_DFA, PREFILTER_NONE, ENGINE_DFA},
+        {"(a|b)*c", "xabac", ENGINE_DFA, PREFILTER_NONE, ENGINE_BACKTRACKER},
+        {"(a|a)*(?>a*)a", "aaaa", ENGINE_BACKTRACKER, PREFILTER_GLUSHKOV, ENGINE_BACKTRACKER},
+        {"(a|a)*(?>a*)a", "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", ENGINE_BACKTRACKER, PREFILTER_GLUSHKOV, ENGINE_MEMOIZED},
+    };
+    char *names[] = {"the backtracker", "the memo", "the one-pass engine", "the DFA", "the reverse DFA"};
+    int count = sizeof(tests) / sizeof(tests[0]);
+    rx_t *rx = rx_alloc();
+    matcher_t *m = rx_matcher_alloc();
+    for (int i = 0; i < count; i += 1) {
+        rx_init(rx, strlen(tests[i].regexp), tests[i].regexp);
+        rx_match(rx, m, strlen(tests[i].str), tests[i].str, 0);
+        int pass = rx->plan.engine == tests[i].engine && rx->plan.prefilter == tests[i].prefilter &&
+            m->engine == tests[i].used;
+        char name[100];
+        snprintf(name, sizeof(name), "%s on \"%.10s\" uses %s", tests[i].regexp, tests[i].str, names[tests[i].used]);
+        ok(pass, name);
+    }
+
+    // The - can't start a match, the \d+ has to take a digit before it.
+    char regexp[] = "(\\d+)-(\\d+) (\\w+)\\>(.*)$";
+    rx_init(rx, sizeof(regexp) - 1, regexp);
+    unsigned char *first = rx->plan.first_bytes;
+    ok((first['0' >> 3] & (1 << ('0' & 7))) && !(first['-' >> 3] & (1 << ('-' & 7))), "the first bytes of (\\d+)-(\\d+) are the digits");
+    rx_matcher_free(m);
+    rx_free(rx);
+}
+
+// Tokenizes str the way the scanners example6 generates do, reading it a
+// chunk at a time into a window that drops what's before the current token,
+// and only taking a match once it didn't need to look past the end of the
+// window (m->hit_end). Returns 1 if that finds the same tokens as matching
+// against all of str at once.
+int window_lex (rx_t *rx, matcher_t *m, int size, char *str, int chunk_size) {
+    int str_offset = 0, str_size = 0, pos = 0;
+    char *window = malloc(size + 1);
+    while (1) {
+        while (1) {
+            rx_match(rx, m, str_size, window, pos - str_offset);
+            if (str_offset + str_size == size || !m->hit_end) {
+                break;
+            }
+            int keep = pos - str_offset;
+            memmove(window, window + keep, str_size - keep);
+            str_size -= keep;
+            str_offset = pos;
+            int chunk = size - str_offset - str_size < chunk_size ? size - str_offset - str_size : chunk_size;
+            memcpy(window + str_size, str + str_offset + str_size, chunk);
+            str_size += chunk;
+        }
+        int success = m->success;
+        int token_size = success ? m->cap_size[0] : 0;
+        rx_match(rx, m, size, str, pos);
+        if (m->success != success || (success && (m->cap_str[0] != str + pos || m->cap_size[0] != token_size))) {
+            free(window);
+            return 0;
+        }
+        if (!success || pos == size) {
+            break;
+        }
+        pos += token_size;
+    }
+    free(window);
+    return 1;
+}
+
+// Tokens that go across the end of the window have to be matched again once
+// the next chunk has been read, for every chunk size.
+void test_window () {
+    char regexp[] = "[0-9]+(?:\\.[0-9]+)?|[a-z]+|/\\*.*?\\*/|\"[^\"]*\"|<=|<|\\s+";
+    char str[] = "abc 123.45 /* a * comment */ x<=\"a string\" 7 < 8.5 longerword";
+    int size = sizeof(str) - 1;
+    rx_t *rx = rx_alloc();
+    matcher_t *m = rx_matcher_alloc();
+    rx_init(rx, sizeof(regexp) - 1, regexp);
+    int pass = 1;
+    for (int chunk_size = 1; chunk_size <= size && pass; chunk_size += 1) {
+        pass = window_lex(rx, m, size, str, chunk_size);
+    }
+    ok(pass, "tokens are the same however the input is split into chunks");
+    rx_matcher_free(m);
+    rx_free(rx);
+}
+
 void usage () {
     char str[] =
         "This program runs tests against librx.\n"
@@ -614,6 +904,12 @@ int main (int argc, char **argv) {
     for (int i = 1; i < argc2; i += 1) {
         process_file(argv[i]);
     }
+    test_limits();
+    test_counted_memo();
+    test_resume();
+    test_complexity();
+    test_plan();
+    test_window();
 
     printf("1..%d\n", test_count);
     if (failed_tests) {